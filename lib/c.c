@@ -592,9 +592,10 @@ int ftell(FILE *stream)
 #if defined(__arm__)
     return __syscall(__syscall_lseek, stream, 0, SEEK_CUR);
 #elif defined(__riscv)
-    int result;
-    __syscall(__syscall_lseek, stream, 0, 0, &result, SEEK_CUR);
-    return result;
+    /* llseek stores a 64-bit offset, low word first */
+    int result[2];
+    __syscall(__syscall_lseek, stream, 0, 0, result, SEEK_CUR);
+    return result[0];
 #else
 #error "Unsupported ftell support for current platform"
 #endif
@@ -18,6 +18,10 @@ ARCH_DEFS = \
     \#define PLT_ENT_SIZE 12\n$\
     \#define R_ARCH_JUMP_SLOT 0x16\n$\
     \#define MAX_ARGS_IN_REG 4\n$\
+    \#define REG_CNT 8 /* allocatable registers: r0-r7 */\n$\
+    \#define REG_SCRATCH0 11 /* allocator scratch registers: r11 and lr */\n$\
+    \#define REG_SCRATCH1 14\n$\
+    \#define REG_CALLEE_SAVED 0xF0 /* r4-r7 survive calls */\n$\
     "
 
 # If the running machine has the "fastfetch" tool installed, the build
@@ -13,6 +13,10 @@ ARCH_DEFS = \
     \#define PLT_ENT_SIZE 12\n$\
     \#define R_ARCH_JUMP_SLOT 0x5\n$\
     \#define MAX_ARGS_IN_REG 8\n$\
+    \#define REG_CNT 18 /* allocatable registers: a0-a7, s1-s10 */\n$\
+    \#define REG_SCRATCH0 18 /* allocator scratch registers: s11 and t6 */\n$\
+    \#define REG_SCRATCH1 19\n$\
+    \#define REG_CALLEE_SAVED 0x3FF00 /* s1-s10 survive calls */\n$\
     "
 
 # TODO: Set this variable for RISC-V architecture
@@ -10,13 +10,119 @@
 #include "../config"
 #include "defs.h"
 
+/* Whether the instruction writes the register in its 'dest' field */
+bool writes_dest_reg(ph2_ir_t *ph2_ir)
+{
+    switch (ph2_ir->op) {
+    case OP_store:
+    case OP_global_store:
+    case OP_write:
+    case OP_branch:
+    case OP_jump:
+    case OP_call:
+    case OP_indirect:
+    case OP_load_func:
+    case OP_address_of_func:
+    case OP_return:
+    case OP_define:
+        return false;
+    default:
+        return true;
+    }
+}
+
+/* Whether the instruction calls another function */
+bool is_call_insn(ph2_ir_t *ph2_ir)
+{
+    return ph2_ir->op == OP_call || ph2_ir->op == OP_indirect;
+}
+
+/* Whether 'func' keeps no values on the stack, besides the area reserved for
+ * the arguments of its callees
+ */
+bool has_no_locals(func_t *func)
+{
+    return func->stack_size == (MAX_PARAMS - MAX_ARGS_IN_REG) * 4;
+}
+
+/* Whether a software multiplication or division in 'bb' calls the runtime
+ * helper. Loops keep the inline expansion unless optimizing for size.
+ */
+bool calls_runtime_helper(basic_block_t *bb)
+{
+    return !hard_mul_div && (optimize_size || !bb->loop_depth);
+}
+
+/* Whether the ARM code for the instruction needs r8 as a temporary */
+bool arm_uses_r8(ph2_ir_t *ph2_ir)
+{
+    int plan[MAX_MUL_STEPS];
+
+    switch (ph2_ir->op) {
+    case OP_load_constant:
+        return ph2_ir->src0 < 0;
+    case OP_address_of:
+    case OP_global_address_of:
+        return ph2_ir->src0 > 255;
+    case OP_load:
+    case OP_global_load:
+        return ph2_ir->src0 > 4095;
+    case OP_store:
+    case OP_global_store:
+        return ph2_ir->src1 > 4095;
+    case OP_mod:
+    case OP_div_const:
+    case OP_mod_const:
+        return true;
+    case OP_div:
+        return !hard_mul_div;
+    case OP_mul_const:
+        /* partial products */
+        return mul_const_plan(ph2_ir->src1, plan) > 1;
+    case OP_address_of_func:
+    case OP_load_func:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Note the functions whose address is taken by 'bb' and its successors */
+void arm_mark_address_taken(basic_block_t *bb)
+{
+    for (; bb; bb = bb->rpo_next) {
+        for (ph2_ir_t *insn = bb->ph2_ir_list.head; insn; insn = insn->next) {
+            func_t *func;
+
+            if (insn->op != OP_address_of_func)
+                continue;
+            func = find_func(insn->func_name);
+            func->address_taken = true;
+        }
+    }
+}
+
 /* ARM-specific lowering:
  * - Mark detached conditional branches so codegen can decide between
  *   short/long forms without re-deriving CFG shape.
+ * - Collect the callee-saved registers each function has to preserve.
+ * - Find the functions that may be entered with r9 not holding the global
+ *   stack pointer: those called through a pointer, possibly from external
+ *   code, reload it in their prologue and so save r9.
+ * - Find the leaf functions that need no frame: they call nothing, keep no
+ *   values on the stack and write none of r4-r11 and lr.
+ * - Decide which software divisions call the runtime helper.
  */
 void arm_lower(void)
 {
+    arm_mark_address_taken(GLOBAL_FUNC->bbs);
+    for (func_t *func = FUNC_LIST.head; func; func = func->next)
+        arm_mark_address_taken(func->bbs);
+
     for (func_t *func = FUNC_LIST.head; func; func = func->next) {
+        bool leaf = true, globals = false;
+        int written = 0;
+
         /* Skip function declarations without bodies */
         if (!func->bbs)
             continue;
@@ -29,30 +135,104 @@ void arm_lower(void)
                     /* In SSA, we index 'else_bb' first, and then 'then_bb' */
                     insn->is_branch_detached = (insn->else_bb != bb->rpo_next);
                 }
+
+                if (writes_dest_reg(insn))
+                    written |= 1 << insn->dest;
+                if (arm_uses_r8(insn))
+                    written |= 1 << 8;
+                if (is_call_insn(insn))
+                    leaf = false;
+
+                switch (insn->op) {
+                case OP_global_load:
+                case OP_global_store:
+                case OP_global_address_of:
+                    globals = true;
+                    break;
+                case OP_div:
+                case OP_mod:
+                    /* software division works in r8, r10 and r12, the
+                     * runtime helper in r4-r6 as well but restores them
+                     */
+                    if (!hard_mul_div)
+                        written |= 1 << 10;
+                    insn->calls_runtime_helper = calls_runtime_helper(bb);
+                    if (insn->calls_runtime_helper)
+                        leaf = false;
+                    break;
+                default:
+                    break;
+                }
             }
         }
+
+        /* callees may need the global stack pointer as well */
+        if (func->address_taken && (globals || !leaf))
+            written |= 1 << 9;
+
+        func->frameless = leaf && !(written & 0x4FF0) && has_no_locals(func);
+        if (func->frameless) {
+            func->saved_regs = 0;
+            continue;
+        }
+
+        /* r8 is written by the prologue itself and lr by any call. AAPCS
+         * only asks to preserve r4-r11.
+         */
+        func->saved_regs = (written | (1 << 8) | (1 << 14)) & 0x4FF0;
     }
 }
 
 /* RISC-V-specific lowering:
  * - Mark detached conditional branches
+ * - Collect the s-registers each function has to preserve, as allocator
+ *   register indices.
+ * - Find the leaf functions that need no frame: they call nothing, keep no
+ *   values on the stack and write no s-register.
+ * - Decide which software multiplications and divisions call the runtime
+ *   helpers.
  * - Future: prepare for RISC-V specific patterns
  */
 void riscv_lower(void)
 {
     for (func_t *func = FUNC_LIST.head; func; func = func->next) {
+        bool leaf = true;
+
         /* Skip function declarations without bodies */
         if (!func->bbs)
             continue;
 
+        func->saved_regs = 0;
+
         for (basic_block_t *bb = func->bbs; bb; bb = bb->rpo_next) {
             for (ph2_ir_t *insn = bb->ph2_ir_list.head; insn;
                  insn = insn->next) {
                 /* Mark branches that don't fall through to next block */
                 if (insn->op == OP_branch)
                     insn->is_branch_detached = (insn->else_bb != bb->rpo_next);
+
+                if (writes_dest_reg(insn))
+                    func->saved_regs |= 1 << insn->dest;
+                if (is_call_insn(insn))
+                    leaf = false;
+
+                switch (insn->op) {
+                case OP_mul:
+                case OP_div:
+                case OP_mod:
+                    insn->calls_runtime_helper = calls_runtime_helper(bb);
+                    if (insn->calls_runtime_helper)
+                        leaf = false;
+                    break;
+                default:
+                    break;
+                }
             }
         }
+
+        /* s1-s11; ra is saved by the prologue of every function with a frame */
+        func->saved_regs = func->saved_regs & 0x7FF00;
+        func->frameless = leaf && !func->saved_regs && has_no_locals(func);
     }
 }
 
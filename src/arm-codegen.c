@@ -11,8 +11,37 @@
 #include "defs.h"
 #include "globals.c"
 
+/* Offset of the runtime division helper, or -1 if nothing calls it */
+int divmod_helper_ofs = -1;
+
+/* Size of the code arm_emit_div_const() emits for 'ph2_ir' */
+int arm_div_const_size(ph2_ir_t *ph2_ir)
+{
+    int divisor = ph2_ir->src1, size;
+    int abs_divisor = divisor < 0 ? -divisor : divisor;
+    int magic, shift;
+
+    if (pow2_shift(abs_divisor) > 0) {
+        if (ph2_ir->op == OP_div_const && divisor > 0)
+            return 12;
+        return 16;
+    }
+    div_magic(abs_divisor, &magic, &shift);
+    size = 16;
+    if (magic < 0)
+        size += 4;
+    if (shift > 0)
+        size += 4;
+    if (ph2_ir->op == OP_div_const)
+        return divisor < 0 ? size + 4 : size;
+    if (abs_divisor > 65535)
+        size += 4;
+    return size + 12;
+}
+
 void update_elf_offset(ph2_ir_t *ph2_ir)
 {
+    int plan[MAX_MUL_STEPS];
     func_t *func;
     switch (ph2_ir->op) {
     case OP_load_constant:
@@ -87,25 +116,19 @@ void update_elf_offset(ph2_ir_t *ph2_ir)
         return;
     case OP_call:
         func = find_func(ph2_ir->func_name);
-        if (func->bbs)
+        if (func->bbs || dynlink)
             elf_offset += 4;
-        else if (dynlink) {
-            /* When calling external functions in dynamic linking mode,
-             * the following instructions are required:
-             * - movw + movt: set r8 to 'elf_data_start'
-             * - ldr: load a word from the address 'elf_data_start' into r12.
-             *        (restore the global stack pointer.)
-             *
-             * Therefore, the total offset is 16 bytes (4 instructions).
-             */
-            elf_offset += 16;
-        } else {
+        else {
             printf("The '%s' function is not implemented\n", ph2_ir->func_name);
             abort();
         }
         return;
     case OP_div:
     case OP_mod:
+        if (ph2_ir->calls_runtime_helper) {
+            elf_offset += 16;
+            return;
+        }
         if (hard_mul_div) {
             if (ph2_ir->op == OP_div)
                 elf_offset += 4;
@@ -116,6 +139,13 @@ void update_elf_offset(ph2_ir_t *ph2_ir)
         /* div/mod emulation's offset */
         elf_offset += 116;
         return;
+    case OP_div_const:
+    case OP_mod_const:
+        elf_offset += arm_div_const_size(ph2_ir);
+        return;
+    case OP_mul_const:
+        elf_offset += mul_const_plan(ph2_ir->src1, plan) * 4;
+        return;
     case OP_load_data_address:
     case OP_load_rodata_address:
         elf_offset += 8;
@@ -137,7 +167,13 @@ void update_elf_offset(ph2_ir_t *ph2_ir)
             elf_offset += 8;
         return;
     case OP_return:
-        elf_offset += 24;
+        /* a frameless function only moves its result and returns */
+        if (ph2_ir->src1 < 0 && ph2_ir->src0 > 0)
+            elf_offset += 8;
+        else if (ph2_ir->src1 < 0)
+            elf_offset += 4;
+        else
+            elf_offset += 24;
         return;
     case OP_trunc:
         if (ph2_ir->src1 == 2)
@@ -156,13 +192,24 @@ void update_elf_offset(ph2_ir_t *ph2_ir)
     }
 }
 
+/* Bytes taken by pushing the registers in 'mask' */
+int saved_regs_size(int mask)
+{
+    int size = 0;
+
+    for (; mask; mask = mask >> 1)
+        size += (mask & 1) << 2;
+    return size;
+}
+
 void cfg_flatten(void)
 {
     func_t *func;
+    bool divmod_used = false;
 
     if (dynlink)
         elf_offset =
-            100; /* offset of __libc_start_main + main_wrapper in codegen */
+            96; /* offset of __libc_start_main + main_wrapper in codegen */
     else {
         func = find_func("__syscall");
         func->bbs->elf_offset = 32; /* offset of start + branch in codegen */
@@ -178,7 +225,7 @@ void cfg_flatten(void)
 
     /* prepare 'argc' and 'argv', then proceed to 'main' function */
     if (dynlink)
-        elf_offset += 28;
+        elf_offset += 40;
     else
         elf_offset += 32; /* 6 insns for main call + 2 for exit */
 
@@ -187,29 +234,36 @@ void cfg_flatten(void)
         if (!func->bbs)
             continue;
 
-        /* reserve stack */
+        /* reserve stack, a size of -1 marks a function without a frame */
+        int stack_size = func->frameless ? -1 : func->stack_size;
         ph2_ir_t *flatten_ir = add_ph2_ir(OP_define);
-        flatten_ir->src0 = func->stack_size;
+        flatten_ir->src0 = stack_size;
+        flatten_ir->src1 = func->saved_regs;
         strncpy(flatten_ir->func_name, func->return_def.var_name, MAX_VAR_LEN);
 
         /* The actual offset of the top of the local stack is the sum of:
-         * - 36 bytes (pushing registers r4-r11 and lr onto the stack)
-         * - 4 bytes
-         *   (to ensure 8-byte alignment after pushing the 9 registers)
+         * - 4 bytes for each register in func->saved_regs
+         * - 4 bytes if their count is odd, to keep sp 8-byte aligned
          * - ALIGN_UP(func->stack_size, 8)
          *
-         * Note that func->stack_size does not include the 36 + 4 bytes,
-         * so an additional 40 bytes should be added to
-         * ALIGN_UP(func->stack_size, 8).
+         * Note that func->stack_size does not include the saved registers.
+         * A frameless function leaves sp where its caller put it.
          */
-        int stack_top_ofs = ALIGN_UP(func->stack_size, MIN_ALIGNMENT) + 40;
+        int saved_size = saved_regs_size(func->saved_regs);
+        int stack_top_ofs = ALIGN_UP(func->stack_size, MIN_ALIGNMENT) +
+                            ALIGN_UP(saved_size, MIN_ALIGNMENT);
+        if (func->frameless)
+            stack_top_ofs = 0;
 
         for (basic_block_t *bb = func->bbs; bb; bb = bb->rpo_next) {
             bb->elf_offset = elf_offset;
 
-            if (bb == func->bbs) {
-                /* retrieve the global stack pointer and save ra, sp */
-                elf_offset += 28;
+            if (bb == func->bbs && !func->frameless) {
+                /* save the registers and allocate the local stack */
+                elf_offset += 16;
+                /* retrieve the global stack pointer */
+                if (func->saved_regs & (1 << 9))
+                    elf_offset += 12;
             }
 
             for (ph2_ir_t *insn = bb->ph2_ir_list.head; insn;
@@ -237,16 +291,25 @@ void cfg_flatten(void)
                 flatten_ir = add_existed_ph2_ir(insn);
 
                 if (insn->op == OP_return) {
-                    /* restore sp */
-                    flatten_ir->src1 = bb->belong_to->stack_size;
+                    /* restore sp and the saved registers */
+                    flatten_ir->src1 = stack_size;
+                    flatten_ir->dest = func->saved_regs;
                 }
 
                 /* Branch detachment is determined in the arch-lowering stage */
 
+                if (flatten_ir->calls_runtime_helper)
+                    divmod_used = true;
                 update_elf_offset(flatten_ir);
             }
         }
     }
+
+    /* the runtime helper follows the last function */
+    if (divmod_used) {
+        divmod_helper_ofs = elf_offset;
+        elf_offset += 128;
+    }
 }
 
 void emit(int code)
@@ -254,6 +317,140 @@ void emit(int code)
     elf_write_int(elf_code, code);
 }
 
+/* Division and modulo of rn by a constant without dividing. Powers of 2 are
+ * shifts, with negative dividends biased by 2^k - 1 to round toward zero.
+ * Other divisors multiply by a fixed-point reciprocal, see div_magic(). The
+ * remainder is rn minus the quotient times the divisor.
+ */
+void arm_emit_div_const(ph2_ir_t *ph2_ir)
+{
+    int rd = ph2_ir->dest, rn = ph2_ir->src0, divisor = ph2_ir->src1;
+    int abs_divisor = divisor < 0 ? -divisor : divisor;
+    int shift = pow2_shift(abs_divisor), magic;
+
+    if (shift > 0) {
+        emit(__srl_amt(__AL, 0, arith_rs, __r8, rn, 31));
+        emit(__add_rs(__AL, __r8, rn, __r8, logic_rs, 32 - shift));
+        if (ph2_ir->op == OP_mod_const) {
+            emit(__srl_amt(__AL, 0, arith_rs, __r8, __r8, shift));
+            emit(__sub_rs(__AL, rd, rn, __r8, logic_ls, shift));
+        } else if (divisor > 0)
+            emit(__srl_amt(__AL, 0, arith_rs, rd, __r8, shift));
+        else {
+            emit(__srl_amt(__AL, 0, arith_rs, __r8, __r8, shift));
+            emit(__rsb_i(__AL, rd, 0, __r8));
+        }
+        return;
+    }
+
+    div_magic(abs_divisor, &magic, &shift);
+    emit(__movw(__AL, __r8, magic));
+    emit(__movt(__AL, __r8, magic));
+    emit(__smull(__AL, __r12, __r8, rn, __r8));
+    if (magic < 0)
+        emit(__add_r(__AL, __r8, __r8, rn));
+    if (shift > 0)
+        emit(__srl_amt(__AL, 0, arith_rs, __r8, __r8, shift));
+    /* the estimate is one below the quotient of negative dividends */
+    if (ph2_ir->op == OP_div_const && divisor > 0) {
+        emit(__add_rs(__AL, rd, __r8, rn, logic_rs, 31));
+        return;
+    }
+    emit(__add_rs(__AL, __r8, __r8, rn, logic_rs, 31));
+    if (ph2_ir->op == OP_div_const) {
+        emit(__rsb_i(__AL, rd, 0, __r8));
+        return;
+    }
+    emit(__movw(__AL, __r12, abs_divisor));
+    if (abs_divisor > 65535)
+        emit(__movt(__AL, __r12, abs_divisor));
+    emit(__mul(__AL, __r8, __r8, __r12));
+    emit(__sub_r(__AL, rd, rn, __r8));
+}
+
+/* Multiplication of rn by a constant in the steps of mul_const_plan(), each a
+ * single instruction with the barrel shifter. Partial products go to r8 and
+ * the last step writes rd.
+ */
+void arm_emit_mul_const(ph2_ir_t *ph2_ir)
+{
+    int plan[MAX_MUL_STEPS];
+    int rd = ph2_ir->dest, rn = ph2_ir->src0, p = rn;
+
+    mul_const_plan(ph2_ir->src1, plan);
+    for (int i = 1; i <= plan[0]; i++) {
+        int k = plan[i] & 31, dest = __r8;
+
+        if (i == plan[0])
+            dest = rd;
+        switch (plan[i] >> 5) {
+        case MUL_ADD_X:
+            emit(__add_rs(__AL, dest, rn, p, logic_ls, k));
+            break;
+        case MUL_SUB_X:
+            emit(__rsb_rs(__AL, dest, rn, p, logic_ls, k));
+            break;
+        case MUL_ADD_P:
+            emit(__add_rs(__AL, dest, p, p, logic_ls, k));
+            break;
+        case MUL_SUB_P:
+            emit(__rsb_rs(__AL, dest, p, p, logic_ls, k));
+            break;
+        case MUL_SHIFT:
+            emit(__sll_amt(__AL, 0, logic_ls, dest, p, k));
+            break;
+        default: /* MUL_NEGATE */
+            emit(__rsb_i(__AL, dest, 0, p));
+            break;
+        }
+        p = __r8;
+    }
+}
+
+/* Runtime helper for the software division of r8 by r12. It returns the
+ * quotient in r8 and the remainder in r12, and clobbers r10 and the flags
+ * only, so its callers keep their values in r0-r7.
+ */
+void arm_emit_divmod_helper(void)
+{
+    emit(__stmdb(__AL, 1, __sp, 0x0070));
+    /* Obtain absolute values of the dividend and divisor */
+    emit(__srl_amt(__AL, 0, arith_rs, __r10, __r8, 31));
+    emit(__add_r(__AL, __r8, __r8, __r10));
+    emit(__eor_r(__AL, __r8, __r8, __r10));
+    emit(__srl_amt(__AL, 0, arith_rs, __r4, __r12, 31));
+    emit(__add_r(__AL, __r12, __r12, __r4));
+    emit(__eor_r(__AL, __r12, __r12, __r4));
+    /* r4 holds the sign of the quotient, r10 that of the remainder */
+    emit(__eor_r(__AL, __r4, __r4, __r10));
+    /* Unsigned integer division */
+    emit(__zero(__r5));
+    emit(__mov_i(__AL, __r6, 1));
+    emit(__cmp_i(__AL, __r12, 0));
+    emit(__b(__EQ, 52));
+    emit(__cmp_i(__AL, __r8, 0));
+    emit(__b(__EQ, 44));
+    emit(__cmp_r(__AL, __r12, __r8));
+    emit(__sll_amt(__CC, 0, logic_ls, __r12, __r12, 1));
+    emit(__sll_amt(__CC, 0, logic_ls, __r6, __r6, 1));
+    emit(__b(__CC, -12));
+    emit(__cmp_r(__AL, __r8, __r12));
+    emit(__sub_r(__CS, __r8, __r8, __r12));
+    emit(__add_r(__CS, __r5, __r5, __r6));
+    emit(__srl_amt(__AL, 1, logic_rs, __r6, __r6, 1));
+    emit(__srl_amt(__CC, 0, logic_rs, __r12, __r12, 1));
+    emit(__b(__CC, -20));
+    /* Handle the correct signs for the quotient and remainder */
+    emit(__mov_r(__AL, __r12, __r8));
+    emit(__mov_r(__AL, __r8, __r5));
+    emit(__cmp_i(__AL, __r4, 0));
+    emit(__rsb_i(__NE, __r8, 0, __r8));
+    emit(__cmp_i(__AL, __r10, 0));
+    emit(__rsb_i(__NE, __r12, 0, __r12));
+    emit(__ldm(__AL, 1, __sp, 0x0070));
+    emit(__bx(__AL, __lr));
+}
+
 void emit_ph2_ir(ph2_ir_t *ph2_ir)
 {
     func_t *func;
@@ -261,7 +458,7 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
     const int rn = ph2_ir->src0;
     int rm = ph2_ir->src1; /* Not const because OP_trunc modifies it */
     int ofs;
-    bool is_external_call = false;
+    arm_cond_t cond;
 
     /* Prepare this variable to reuse code for:
      * 1. division and modulo operations
@@ -278,23 +475,32 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
          *   and the stack must always be 8-byte aligned.
          * - lr must be pushed because it may be modified when the function
          *   calls another function.
-         * - since external functions may call internal functions, r12 may not
-         *   hold the global stack pointer.
+         * - r9 holds the global stack pointer, which only a function called
+         *   through a pointer may find missing, as external functions may
+         *   call it. Such a function saves r9.
          *
          * Therefore, we perform the following operations:
-         * 1. use a __stmdb instruction to push r4-r11 and lr onto the stack
-         *    first.
-         * 2. retrieve the global stack pointer from the 4-byte global object
-         *    located at 'elf_data_start' to ensure correct access to the global
-         *    stack.
-         * 3. set ofs to align(ph2_ir->src0, 8) + 4, and prepare a local
-         *    stack for the callee by subtracting ofs from sp.
+         * 1. use a __stmdb instruction to push the registers of r4-r11 and lr
+         *    the function writes (ph2_ir->src1) onto the stack first.
+         * 2. if r9 was saved, retrieve the global stack pointer from the
+         *    4-byte global object located at 'elf_data_start'.
+         * 3. set ofs to align(ph2_ir->src0, 8), plus 4 if an odd number of
+         *    registers was pushed, and prepare a local stack for the callee by
+         *    subtracting ofs from sp.
+         *
+         * A leaf function touching neither the stack, r4-r11 nor lr needs
+         * none of these and has ph2_ir->src0 set to -1.
          */
-        emit(__stmdb(__AL, 1, __sp, 0x4FF0));
-        emit(__movw(__AL, __r8, elf_data_start));
-        emit(__movt(__AL, __r8, elf_data_start));
-        emit(__lw(__AL, __r12, __r8, 0));
-        ofs = ALIGN_UP(ph2_ir->src0, MIN_ALIGNMENT) + 4;
+        if (ph2_ir->src0 < 0)
+            return;
+        emit(__stmdb(__AL, 1, __sp, ph2_ir->src1));
+        if (ph2_ir->src1 & (1 << 9)) {
+            emit(__movw(__AL, __r9, elf_data_start));
+            emit(__movt(__AL, __r9, elf_data_start));
+            emit(__lw(__AL, __r9, __r9, 0));
+        }
+        ofs = ALIGN_UP(ph2_ir->src0, MIN_ALIGNMENT) +
+              (saved_regs_size(ph2_ir->src1) & 4);
         emit(__movw(__AL, __r8, ofs));
         emit(__movt(__AL, __r8, ofs));
         emit(__sub_r(__AL, __sp, __sp, __r8));
@@ -312,7 +518,7 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
         return;
     case OP_address_of:
     case OP_global_address_of:
-        interm = ph2_ir->op == OP_address_of ? __sp : __r12;
+        interm = ph2_ir->op == OP_address_of ? __sp : __r9;
         if (ph2_ir->src0 > 255) {
             emit(__movw(__AL, __r8, ph2_ir->src0));
             emit(__movt(__AL, __r8, ph2_ir->src0));
@@ -321,11 +527,12 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
             emit(__add_i(__AL, rd, interm, ph2_ir->src0));
         return;
     case OP_assign:
-        emit(__mov_r(__AL, rd, rn));
+        if (rd != rn)
+            emit(__mov_r(__AL, rd, rn));
         return;
     case OP_load:
     case OP_global_load:
-        interm = ph2_ir->op == OP_load ? __sp : __r12;
+        interm = ph2_ir->op == OP_load ? __sp : __r9;
         if (ph2_ir->src0 > 4095) {
             emit(__movw(__AL, __r8, ph2_ir->src0));
             emit(__movt(__AL, __r8, ph2_ir->src0));
@@ -336,7 +543,7 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
         return;
     case OP_store:
     case OP_global_store:
-        interm = ph2_ir->op == OP_store ? __sp : __r12;
+        interm = ph2_ir->op == OP_store ? __sp : __r9;
         if (ph2_ir->src1 > 4095) {
             emit(__movw(__AL, __r8, ph2_ir->src1));
             emit(__movt(__AL, __r8, ph2_ir->src1));
@@ -346,8 +553,11 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
             emit(__sw(__AL, rn, interm, ph2_ir->src1));
         return;
     case OP_read:
+        /* a negative size reads a sign-extended byte, see known_bits() */
         if (ph2_ir->src1 == 1)
             emit(__lb(__AL, rd, rn, 0));
+        else if (ph2_ir->src1 == -1)
+            emit(__lsb(__AL, rd, rn, 0));
         else if (ph2_ir->src1 == 2)
             emit(__lh(__AL, rd, rn, 0));
         else if (ph2_ir->src1 == 4)
@@ -366,12 +576,20 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
             abort();
         return;
     case OP_branch:
-        emit(__teq(rn));
-        if (ph2_ir->is_branch_detached) {
-            emit(__b(__NE, 8));
+        /* a fused comparison sets the flags itself, see ra_fusible_branch() */
+        if (ph2_ir->branch_cmp == OP_generic) {
+            emit(__teq(rn));
+            cond = __NE;
+        } else {
+            emit(__cmp_r(__AL, rn, rm));
+            cond = arm_get_cond(ph2_ir->branch_cmp);
+        }
+        /* the 'then' block need not follow either: a critical edge into it
+         * is split by a block placed before its target
+         */
+        emit(__b(cond, ph2_ir->then_bb->elf_offset - elf_code->size));
+        if (ph2_ir->is_branch_detached)
             emit(__b(__AL, ph2_ir->else_bb->elf_offset - elf_code->size));
-        } else
-            emit(__b(__NE, ph2_ir->then_bb->elf_offset - elf_code->size));
         return;
     case OP_jump:
         emit(__b(__AL, ph2_ir->next_bb->elf_offset - elf_code->size));
@@ -380,36 +598,18 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
         func = find_func(ph2_ir->func_name);
         if (func->bbs)
             ofs = func->bbs->elf_offset - elf_code->size;
-        else if (dynlink) {
+        else if (dynlink)
             ofs = (dynamic_sections.elf_plt_start + func->plt_offset) -
                   (elf_code_start + elf_code->size);
-            is_external_call = true;
-        } else {
+        else {
             printf("The '%s' function is not implemented\n", ph2_ir->func_name);
             abort();
         }
 
-        /* When calling external functions in dynamic linking mode,
-         * the following instructions are required:
-         * - movw + movt: set r8 to 'elf_data_start'
-         * - ldr: load a word from the address 'elf_data_start' to r12.
-         *        (restore the global stack pointer.)
-         *
-         * Since shecc uses r12 to store a global stack pointer and external
-         * functions can freely modify r12, causing internal functions to
-         * access global variables incorrectly, additional instructions are
-         * needed to restore r12 from the global object after the external
-         * function returns.
-         *
-         * Otherwise, only a 'bl' instruction is generated to call internal
-         * functions because shecc guarantees they do not modify r12.
+        /* The global stack pointer lives in r9, which external functions
+         * preserve like any other callee-saved register.
          */
         emit(__bl(__AL, ofs));
-        if (is_external_call) {
-            emit(__movw(__AL, __r8, elf_data_start));
-            emit(__movt(__AL, __r8, elf_data_start));
-            emit(__lw(__AL, __r12, __r8, 0));
-        }
         return;
     case OP_load_data_address:
         emit(__movw(__AL, rd, ph2_ir->src0 + elf_data_start));
@@ -440,25 +640,35 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
         emit(__blx(__AL, __r8));
         return;
     case OP_return:
+        if (ph2_ir->src1 < 0) {
+            /* frameless function */
+            if (rn > 0)
+                emit(__mov_r(__AL, __r0, rn));
+            emit(__bx(__AL, __lr));
+            return;
+        }
+
         if (ph2_ir->src0 == -1)
             emit(__mov_r(__AL, __r0, __r0));
         else
             emit(__mov_r(__AL, __r0, rn));
 
         /* When calling a function, the following operations are performed:
-         * 1. push r4-r11 and lr onto the stack.
+         * 1. push the saved registers (ph2_ir->dest) onto the stack.
          * 2. retrieve the global stack pointer from the 4-byte global object.
-         * 3. decrement the stack by ALIGN_UP(stack_size, 8) + 4.
+         * 3. decrement the stack by ALIGN_UP(stack_size, 8), plus the padding
+         *    for an odd number of saved registers.
          *
          * Except for step 2, the reversed operations should be performed to
-         * upon returning to restore the stack and the contents of r4-r11 and
-         * lr.
+         * upon returning to restore the stack and the contents of the saved
+         * registers.
          */
-        ofs = ALIGN_UP(ph2_ir->src1, MIN_ALIGNMENT) + 4;
+        ofs = ALIGN_UP(ph2_ir->src1, MIN_ALIGNMENT) +
+              (saved_regs_size(ph2_ir->dest) & 4);
         emit(__movw(__AL, __r8, ofs));
         emit(__movt(__AL, __r8, ofs));
         emit(__add_r(__AL, __sp, __sp, __r8));
-        emit(__ldm(__AL, 1, __sp, 0x4FF0));
+        emit(__ldm(__AL, 1, __sp, ph2_ir->dest));
         emit(__bx(__AL, __lr));
         return;
     case OP_add:
@@ -482,6 +692,16 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
             }
             return;
         }
+        if (ph2_ir->calls_runtime_helper) {
+            emit(__mov_r(__AL, __r8, rn));
+            emit(__mov_r(__AL, __r12, rm));
+            emit(__bl(__AL, divmod_helper_ofs - elf_code->size));
+            if (ph2_ir->op == OP_div)
+                emit(__mov_r(__AL, rd, __r8));
+            else
+                emit(__mov_r(__AL, rd, __r12));
+            return;
+        }
         interm = __r8;
         /* div/mod emulation */
         /* Preserve the values of the dividend and divisor */
@@ -490,51 +710,58 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
         emit(__srl_amt(__AL, 0, arith_rs, __r8, rn, 31));
         emit(__add_r(__AL, rn, rn, __r8));
         emit(__eor_r(__AL, rn, rn, __r8));
-        emit(__srl_amt(__AL, 0, arith_rs, __r9, rm, 31));
-        emit(__add_r(__AL, rm, rm, __r9));
-        emit(__eor_r(__AL, rm, rm, __r9));
+        emit(__srl_amt(__AL, 0, arith_rs, __r12, rm, 31));
+        emit(__add_r(__AL, rm, rm, __r12));
+        emit(__eor_r(__AL, rm, rm, __r12));
         if (ph2_ir->op == OP_div)
-            emit(__eor_r(__AL, __r10, __r8, __r9));
+            emit(__eor_r(__AL, __r10, __r8, __r12));
         else {
             /* If the requested operation is modulo, the result will be stored
-             * in __r9. The sign of the divisor is irrelevant for determining
+             * in __r12. The sign of the divisor is irrelevant for determining
              * the result's sign.
              */
-            interm = __r9;
+            interm = __r12;
             emit(__mov_r(__AL, __r10, __r8));
         }
         /* Unsigned integer division */
         emit(__zero(__r8));
-        emit(__mov_i(__AL, __r9, 1));
+        emit(__mov_i(__AL, __r12, 1));
         emit(__cmp_i(__AL, rm, 0));
         emit(__b(__EQ, 52));
         emit(__cmp_i(__AL, rn, 0));
         emit(__b(__EQ, 44));
         emit(__cmp_r(__AL, rm, rn));
         emit(__sll_amt(__CC, 0, logic_ls, rm, rm, 1));
-        emit(__sll_amt(__CC, 0, logic_ls, __r9, __r9, 1));
+        emit(__sll_amt(__CC, 0, logic_ls, __r12, __r12, 1));
         emit(__b(__CC, -12));
         emit(__cmp_r(__AL, rn, rm));
         emit(__sub_r(__CS, rn, rn, rm));
-        emit(__add_r(__CS, __r8, __r8, __r9));
-        emit(__srl_amt(__AL, 1, logic_rs, __r9, __r9, 1));
+        emit(__add_r(__CS, __r8, __r8, __r12));
+        emit(__srl_amt(__AL, 1, logic_rs, __r12, __r12, 1));
         emit(__srl_amt(__CC, 0, logic_rs, rm, rm, 1));
         emit(__b(__CC, -20));
         /* After completing the emulation, the quotient and remainder will be
-         * stored in __r8 and __r9, respectively.
+         * stored in __r8 and __r12, respectively.
          *
          * The original values of the dividend and divisor will be restored in
          * rn and rm.
          *
          * Finally, the result (quotient or remainder) will be stored in rd.
          */
-        emit(__mov_r(__AL, __r9, rn));
+        emit(__mov_r(__AL, __r12, rn));
         emit(__ldm(__AL, 1, __sp, (1 << rn) | (1 << rm)));
         emit(__mov_r(__AL, rd, interm));
         /* Handle the correct sign for the quotient or remainder */
         emit(__cmp_i(__AL, __r10, 0));
         emit(__rsb_i(__NE, rd, 0, rd));
         return;
+    case OP_div_const:
+    case OP_mod_const:
+        arm_emit_div_const(ph2_ir);
+        return;
+    case OP_mul_const:
+        arm_emit_mul_const(ph2_ir);
+        return;
     case OP_lshift:
         emit(__sll(__AL, rd, rn, rm));
         return;
@@ -636,11 +863,11 @@ void code_generate(void)
          * point of 'main_wrapper' is located here.
          *
          * Push the contents of r4-r11 and lr onto stack.
-         * Preserve 'argc' and 'argv' for the 'main' function.
+         * Preserve 'argc' and 'argv' for the 'main' function right above
+         * the global stack.
          */
         emit(__stmdb(__AL, 1, __sp, 0x4FF0));
-        emit(__mov_r(__AL, __r9, __r0));
-        emit(__mov_r(__AL, __r10, __r1));
+        emit(__stmdb(__AL, 1, __sp, 0x0003));
     }
     /* For both static and dynamic linking, we need to set up the stack
      * and call the main function.
@@ -649,8 +876,8 @@ void code_generate(void)
      * 'ofs' is to align(GLOBAL_FUNC->stack_size, 8) to allocate space
      * for the global stack.
      *
-     * In dynamic linking mode, since the preceding __stmdb instruction
-     * pushes 9 registers onto stack, 'ofs' must be increased by 4 to
+     * In dynamic linking mode, since the preceding __stmdb instructions
+     * push 11 registers onto stack, 'ofs' must be increased by 4 to
      * prevent the stack from becoming misaligned.
      */
     ofs = ALIGN_UP(GLOBAL_FUNC->stack_size, MIN_ALIGNMENT);
@@ -659,14 +886,14 @@ void code_generate(void)
     emit(__movw(__AL, __r8, ofs));
     emit(__movt(__AL, __r8, ofs));
     emit(__sub_r(__AL, __sp, __sp, __r8));
-    emit(__mov_r(__AL, __r12, __sp));
-    /* The first object in the .data section is used to store the global
-     * stack pointer. Therefore, store r12 at the address 'elf_data_start'
-     * after the global stack has been prepared.
+    emit(__mov_r(__AL, __r9, __sp));
+    /* The global stack pointer stays in r9 from here on. The first object
+     * in the .data section keeps a copy for the functions external code may
+     * call, so store r9 at the address 'elf_data_start'.
      */
     emit(__movw(__AL, __r8, elf_data_start));
     emit(__movt(__AL, __r8, elf_data_start));
-    emit(__sw(__AL, __r12, __r8, 0));
+    emit(__sw(__AL, __r9, __r8, 0));
 
     if (!dynlink) {
         /* Jump directly to the main preparation and then execute the
@@ -735,24 +962,27 @@ void code_generate(void)
     /* prepare 'argc' and 'argv', then proceed to 'main' function */
     if (MAIN_BB) {
         if (dynlink) {
-            emit(__mov_r(__AL, __r0, __r9));
-            emit(__mov_r(__AL, __r1, __r10));
+            emit(__movw(__AL, __r8, ofs));
+            emit(__movt(__AL, __r8, ofs));
+            emit(__add_r(__AL, __r8, __r9, __r8));
+            emit(__lw(__AL, __r0, __r8, 0));
+            emit(__lw(__AL, __r1, __r8, 4));
             /* Call the main function.
              *
              * After the main function returns, the following
-             * instructions restore the registers r4-r11 and
-             * return control to __libc_start_main via the
-             * preserved lr.
+             * instructions drop 'argc' and 'argv', restore the
+             * registers r4-r11 and return control to
+             * __libc_start_main via the preserved lr.
              */
             emit(__bl(__AL, MAIN_BB->elf_offset - elf_code->size));
-            emit(__movw(__AL, __r8, ofs));
-            emit(__movt(__AL, __r8, ofs));
+            emit(__movw(__AL, __r8, ofs + 8));
+            emit(__movt(__AL, __r8, ofs + 8));
             emit(__add_r(__AL, __sp, __sp, __r8));
             emit(__ldm(__AL, 1, __sp, 0x8FF0));
         } else {
             emit(__movw(__AL, __r8, ofs));
             emit(__movt(__AL, __r8, ofs));
-            emit(__add_r(__AL, __r8, __r12, __r8));
+            emit(__add_r(__AL, __r8, __r9, __r8));
             emit(__lw(__AL, __r0, __r8, 0));
             emit(__add_i(__AL, __r1, __r8, 4));
 
@@ -771,6 +1001,9 @@ void code_generate(void)
         ph2_ir = PH2_IR_FLATTEN[i];
         emit_ph2_ir(ph2_ir);
     }
+
+    if (divmod_helper_ofs >= 0)
+        arm_emit_divmod_helper();
 }
 
 void plt_generate(void)
@@ -801,9 +1034,9 @@ void plt_generate(void)
      * cannot be modified arbitrarily; otherwise, the program may fail if any
      * of them are changed by PLT[0].
      *
-     * However, r8-r11 can be freely used as temporary registers during code
-     * generation, so PLT[0] arbitrarily chooses r10 to perform the required
-     * operation.
+     * However, r8, r10 and r11 can be freely used as temporary registers
+     * during code generation, so PLT[0] arbitrarily chooses r10 to perform
+     * the required operation.
      */
     int addr_of_got = dynamic_sections.elf_got_start + PTR_SIZE * 2;
     int end = dynamic_sections.plt_size - PLT_FIXUP_SIZE;
@@ -255,6 +255,42 @@ int __sub_r(arm_cond_t cond, arm_reg rd, arm_reg rs, arm_reg ro)
     return __mov(cond, 0, arm_sub, 0, rs, rd, ro);
 }
 
+/* rd = rs + (ro shifted by 'amt') */
+int __add_rs(arm_cond_t cond,
+             arm_reg rd,
+             arm_reg rs,
+             arm_reg ro,
+             shift_type shift,
+             int amt)
+{
+    return arm_encode(cond, arm_add << 1, rs, rd,
+                      ro + (shift << 5) + ((amt & 31) << 7));
+}
+
+/* rd = rs - (ro shifted by 'amt') */
+int __sub_rs(arm_cond_t cond,
+             arm_reg rd,
+             arm_reg rs,
+             arm_reg ro,
+             shift_type shift,
+             int amt)
+{
+    return arm_encode(cond, arm_sub << 1, rs, rd,
+                      ro + (shift << 5) + ((amt & 31) << 7));
+}
+
+/* rd = (ro shifted by 'amt') - rs */
+int __rsb_rs(arm_cond_t cond,
+             arm_reg rd,
+             arm_reg rs,
+             arm_reg ro,
+             shift_type shift,
+             int amt)
+{
+    return arm_encode(cond, arm_rsb << 1, rs, rd,
+                      ro + (shift << 5) + ((amt & 31) << 7));
+}
+
 int __and_i(arm_cond_t cond, arm_reg rd, arm_reg rs, int imm)
 {
     return __mov(cond, 1, arm_and, 0, rs, rd, imm);
@@ -341,6 +377,12 @@ int __lh(arm_cond_t cond, arm_reg rd, arm_reg rn, int ofs)
     return arm_halfword_transfer(cond, 1, rn, rd, ofs, 1);
 }
 
+/* ARM signed byte load (LDRSB): LDRSH without the H bit */
+int __lsb(arm_cond_t cond, arm_reg rd, arm_reg rn, int ofs)
+{
+    return arm_halfword_transfer(cond, 1, rn, rd, ofs, 1) & ~(1 << 5);
+}
+
 /* ARM halfword store (STRH) */
 int __sh(arm_cond_t cond, arm_reg rd, arm_reg rn, int ofs)
 {
@@ -395,6 +437,12 @@ int __mul(arm_cond_t cond, arm_reg rd, arm_reg r1, arm_reg r2)
     return arm_encode(cond, 0, rd, 0, (r1 << 8) + 144 + r2);
 }
 
+/* Signed 64-bit product of r1 and r2 in rdhi:rdlo */
+int __smull(arm_cond_t cond, arm_reg rdlo, arm_reg rdhi, arm_reg r1, arm_reg r2)
+{
+    return arm_encode(cond, 12, rdhi, rdlo, (r2 << 8) + 144 + r1);
+}
+
 int __div(arm_cond_t cond, arm_reg rd, arm_reg r1, arm_reg r2)
 {
     return arm_encode(cond, 113, rd, 15, (r1 << 8) + 16 + r2);
@@ -46,10 +46,11 @@
 #define MAX_PLT 1024
 #define MAX_GOTPLT 1024
 #define MAX_CONSTANTS 1024
-#define MAX_CASES 128
+#define MAX_CASES 1024
 #define MAX_NESTING 128
 #define MAX_OPERAND_STACK_SIZE 32
 #define MAX_ANALYSIS_STACK_SIZE 800
+#define MAX_MUL_STEPS 32
 
 /* Default capacities for common data structures */
 /* Arena sizes optimized based on typical usage patterns */
@@ -75,8 +76,14 @@
 #define ELF_START 0x10000
 #define PTR_SIZE 4
 
-/* Number of the available registers. Either 7 or 8 is accepted now. */
-#define REG_CNT 8
+/* Virtual register flags used by the linear-scan register allocator */
+#define VREG_MEMORY 0x01     /* lives in its stack slot or global storage */
+#define VREG_REMAT 0x02      /* single constant definition, reloaded by value */
+#define VREG_CROSS_CALL 0x04 /* live across a call, written back on definition */
+#define VREG_STALE 0x08      /* register clobbered by a call, not reloaded yet */
+#define VREG_DEFINED 0x10    /* at least one definition has been seen */
+#define VREG_MULTI_DEF 0x20  /* more than one definition */
+#define VREG_SHARED 0x40     /* interval shared with a copy of the value */
 
 /* This macro will be automatically defined at shecc run-time. */
 #ifdef __SHECC__
@@ -270,7 +277,7 @@ typedef enum {
     OP_generic,
 
     OP_phi,
-    OP_unwound_phi, /* work like address_of + store */
+    OP_unwound_phi, /* phi copy at the end of a predecessor */
 
     /* calling convention */
     OP_define,   /* function entry point */
@@ -310,9 +317,12 @@ typedef enum {
     OP_add,
     OP_sub,
     OP_mul,
-    OP_div,     /* signed division */
-    OP_mod,     /* modulo */
-    OP_ternary, /* ? : */
+    OP_div,       /* signed division */
+    OP_mod,       /* modulo */
+    OP_div_const, /* division by the constant in src1 */
+    OP_mod_const, /* modulo by the constant in src1 */
+    OP_mul_const, /* multiplication by the constant in src1 */
+    OP_ternary,   /* ? : */
     OP_lshift,
     OP_rshift,
     OP_log_and,
@@ -339,6 +349,19 @@ typedef enum {
     OP_start
 } opcode_t;
 
+/* Steps of a multiplication of 'x' by a constant, see mul_const_plan(). Each
+ * one computes the next partial product 'p' from the previous one, starting
+ * from x.
+ */
+typedef enum {
+    MUL_ADD_X,  /* p = (p << k) + x */
+    MUL_SUB_X,  /* p = (p << k) - x */
+    MUL_ADD_P,  /* p = (p << k) + p */
+    MUL_SUB_P,  /* p = (p << k) - p */
+    MUL_SHIFT,  /* p = p << k */
+    MUL_NEGATE  /* p = -p */
+} mul_step_t;
+
 /* variable definition */
 typedef struct {
     int counter;
@@ -398,11 +421,17 @@ struct var {
     bool is_const;  /* whether a constant representaion or not */
     int vreg_id;    /* Virtual register ID */
     int phys_reg;   /* Physical register assignment (-1 if unassigned) */
+    int reg_hint;   /* Preferred physical register (-1 if none) */
     int vreg_flags; /* VReg flags */
     int first_use;  /* First instruction index where variable is used */
     int last_use;   /* Last instruction index where variable is used */
     int loop_depth; /* Nesting depth if variable is in a loop */
     int use_count;  /* Number of times variable is used */
+
+    /* Known-bits analysis, see known_bits() */
+    int known_zeros; /* high bits known to be zero, -1 if unknown */
+    int known_signs; /* high bits known to equal the sign bit */
+
     bool space_is_allocated; /* whether space is allocated for this variable */
 
     /* This flag is used to indicate to the compiler that the offset of
@@ -453,6 +482,11 @@ struct ph2_ir {
     struct ph2_ir *next;
     bool is_branch_detached;
 
+    /* The comparison of src0 and src1 an OP_branch evaluates itself, or
+     * OP_generic when it tests src0 against zero
+     */
+    opcode_t branch_cmp;
+
     /* When an instruction uses a variable that its offset is based on
      * the top of the stack, this instruction's flag is also set to
      * indicate the compiler to recalculate the offset after the function's
@@ -462,6 +496,11 @@ struct ph2_ir {
      * to recompute the offset.
      */
     bool ofs_based_on_stack_top;
+
+    /* Set by the arch-lowering stage when a software multiplication or
+     * division calls the runtime helper instead of being expanded inline.
+     */
+    bool calls_runtime_helper;
 };
 
 typedef struct ph2_ir ph2_ir_t;
@@ -560,6 +599,7 @@ struct basic_block {
     var_list_t live_out;
     int rpo;
     int rpo_r;
+    int loop_depth; /* nesting depth, used to weight spill costs */
     struct basic_block *DF[64];
     struct basic_block *RDF[64];
     int df_idx;
@@ -592,6 +632,12 @@ typedef struct {
     bool used;
 } label_t;
 
+/* Consecutive case values sharing one body */
+typedef struct {
+    int lo, hi;
+    basic_block_t *bb;
+} case_range_t;
+
 struct func {
     /* Syntatic info */
     var_t return_def;
@@ -599,6 +645,9 @@ struct func {
     int num_params;
     int va_args;
     int stack_size;
+    int saved_regs; /* callee-saved registers kept by prologue and epilogue */
+    bool frameless; /* leaf entered and left without touching the stack */
+    bool address_taken; /* may be called through a pointer */
 
     /* SSA info */
     basic_block_t *bbs;
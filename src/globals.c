@@ -75,6 +75,20 @@ int elf_offset = 0;
 
 regfile_t REGS[REG_CNT];
 
+/* Linear-scan state of the function being allocated */
+var_t **VREGS;      /* interval owners, indexed by 'vreg_id' */
+int vreg_next;      /* first interval not yet reached by the emission walk */
+int vreg_cnt;
+int *CALL_POS;      /* program points of calls, in increasing order */
+int *CALL_COST;     /* loop-weighted number of calls before each CALL_POS */
+int call_cnt;
+var_t **STALE_VARS; /* values clobbered by a call in the current block */
+int stale_cnt;
+var_t **MEM_VARS; /* values living in memory throughout, by first use */
+int mem_cnt;
+int *PHI_TMP_SLOTS; /* scratch slots of parallel phi copies */
+int phi_tmp_cnt;
+
 hashmap_t *INCLUSION_MAP;
 
 /* ELF sections */
@@ -101,6 +115,7 @@ bool libc = true;
 bool expand_only = false;
 bool dump_ir = false;
 bool hard_mul_div = false;
+bool optimize_size = false;
 
 /* Create a new arena block with given capacity.
  * @capacity: The capacity of the arena block. Must be positive.
@@ -606,6 +621,7 @@ ph2_ir_t *add_ph2_ir(opcode_t op)
     /* Initialize all fields explicitly */
     ph2_ir->next = NULL;
     ph2_ir->is_branch_detached = 0;
+    ph2_ir->branch_cmp = OP_generic;
     ph2_ir->src0 = 0;
     ph2_ir->src1 = 0;
     ph2_ir->dest = 0;
@@ -614,6 +630,7 @@ ph2_ir_t *add_ph2_ir(opcode_t op)
     ph2_ir->then_bb = NULL;
     ph2_ir->else_bb = NULL;
     ph2_ir->ofs_based_on_stack_top = false;
+    ph2_ir->calls_runtime_helper = false;
     return add_existed_ph2_ir(ph2_ir);
 }
 
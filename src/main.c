@@ -61,6 +61,8 @@ int main(int argc, char *argv[])
             dump_ir = true;
         else if (!strcmp(argv[i], "+m"))
             hard_mul_div = true;
+        else if (!strcmp(argv[i], "-Os"))
+            optimize_size = true;
         else if (!strcmp(argv[i], "--no-libc"))
             libc = false;
         else if (!strcmp(argv[i], "--dynlink"))
@@ -83,8 +85,8 @@ int main(int argc, char *argv[])
     if (!in) {
         printf("Missing source file!\n");
         printf(
-            "Usage: shecc [-o output] [+m] [--dump-ir] [--no-libc] [--dynlink] "
-            "[-E]"
+            "Usage: shecc [-o output] [+m] [-Os] [--dump-ir] [--no-libc] "
+            "[--dynlink] [-E]"
             "<input.c>\n");
         exit(-1);
     }
@@ -0,0 +1,276 @@
+/*
+ * shecc - Self-Hosting and Educational C Compiler.
+ *
+ * shecc is freely redistributable under the BSD 2 clause license. See the
+ * file "LICENSE" for information on usage and redistribution of this file.
+ */
+
+/* Known-bits analysis
+ *
+ * Tracks how many high bits of each SSA value are known to be zero and how
+ * many are known to equal its sign bit, and turns the truncations, sign
+ * extensions and masks that cannot change such a value into copies. Byte
+ * reads zero-extend like a truncation to char, halfword reads sign-extend and
+ * comparisons yield 0 or 1, so many of the extensions around char and short
+ * arithmetic go away. A byte read only used by a sign extension becomes a
+ * sign-extending read, marked by a negative size.
+ *
+ * Blocks are visited once in reverse postorder. Operands only defined later,
+ * across a loop back edge, and variables assigned more than once are taken
+ * as unknown.
+ */
+
+/* Number of leading bits of 'value' equal to 'bit' */
+int kb_leading(int value, int bit)
+{
+    int count = 0;
+
+    while (count < 32 && ((value >> (31 - count)) & 1) == bit)
+        count++;
+    return count;
+}
+
+/* High bits of 'var' known to be zero */
+int kb_zeros(var_t *var)
+{
+    if (!var || var->is_global)
+        return 0;
+    if (var->is_const)
+        return kb_leading(var->init_val, 0);
+    if (var->known_zeros < 0)
+        return 0;
+    return var->known_zeros;
+}
+
+/* High bits of 'var' known to equal its sign bit, counting the sign bit */
+int kb_signs(var_t *var)
+{
+    if (!var || var->is_global)
+        return 1;
+    if (var->is_const)
+        return kb_leading(var->init_val, (var->init_val >> 31) & 1);
+    if (var->known_zeros < 0)
+        return 1;
+    return var->known_signs;
+}
+
+/* Whether every bit 'var' may have set is also set in 'mask' */
+bool kb_within_mask(var_t *var, int mask)
+{
+    int zeros = kb_zeros(var);
+
+    if (zeros == 0)
+        return mask == -1;
+    if (zeros == 32)
+        return true;
+    return !(((1 << (32 - zeros)) - 1) & ~mask);
+}
+
+/* The byte read whose value reaches nothing but 'var', possibly through
+ * copies, or NULL
+ */
+insn_t *kb_byte_read(var_t *var)
+{
+    while (!var->is_global && var->known_zeros >= 0 && var->use_count == 1) {
+        insn_t *def = var->last_assign;
+
+        if (def->opcode == OP_read && def->sz == 1)
+            return def;
+        if (def->opcode != OP_assign)
+            return NULL;
+        var = def->rs1;
+    }
+    return NULL;
+}
+
+/* Known bits of the value 'insn' defines, in 'zeros' and 'signs'. Extensions
+ * and masks that leave their operand unchanged become copies.
+ */
+void kb_eval(insn_t *insn, int *zeros, int *signs)
+{
+    insn_t *read;
+    int z = 0, s = 1, bits;
+
+    switch (insn->opcode) {
+    case OP_load_constant:
+        z = kb_zeros(insn->rd);
+        s = kb_signs(insn->rd);
+        break;
+    case OP_assign:
+    case OP_cast:
+        z = kb_zeros(insn->rs1);
+        s = kb_signs(insn->rs1);
+        break;
+    case OP_phi:
+        z = 32;
+        s = 32;
+        for (phi_operand_t *op = insn->phi_ops; op; op = op->next) {
+            if (kb_zeros(op->var) < z)
+                z = kb_zeros(op->var);
+            if (kb_signs(op->var) < s)
+                s = kb_signs(op->var);
+        }
+        break;
+    case OP_eq:
+    case OP_neq:
+    case OP_lt:
+    case OP_leq:
+    case OP_gt:
+    case OP_geq:
+    case OP_log_not:
+        z = 31;
+        break;
+    case OP_bit_and:
+        if (insn->rs2->is_const && kb_within_mask(insn->rs1,
+                                                  insn->rs2->init_val)) {
+            insn->opcode = OP_assign;
+            insn->rs2 = NULL;
+            z = kb_zeros(insn->rs1);
+            s = kb_signs(insn->rs1);
+            break;
+        }
+        z = kb_zeros(insn->rs1);
+        if (kb_zeros(insn->rs2) > z)
+            z = kb_zeros(insn->rs2);
+        s = kb_signs(insn->rs1);
+        if (kb_signs(insn->rs2) < s)
+            s = kb_signs(insn->rs2);
+        break;
+    case OP_bit_or:
+    case OP_bit_xor:
+        z = kb_zeros(insn->rs1);
+        if (kb_zeros(insn->rs2) < z)
+            z = kb_zeros(insn->rs2);
+        s = kb_signs(insn->rs1);
+        if (kb_signs(insn->rs2) < s)
+            s = kb_signs(insn->rs2);
+        break;
+    case OP_rshift:
+        /* arithmetic shift by a constant */
+        if (!insn->rs2->is_const || insn->rs2->init_val < 0 ||
+            insn->rs2->init_val > 31)
+            break;
+        s = kb_signs(insn->rs1) + insn->rs2->init_val;
+        if (kb_zeros(insn->rs1))
+            z = kb_zeros(insn->rs1) + insn->rs2->init_val;
+        break;
+    case OP_read:
+        if (insn->sz == 1)
+            z = 24;
+        else if (insn->sz < 0 || insn->sz == 2)
+            s = insn->sz < 0 ? 33 + insn->sz * 8 : 17;
+        break;
+    case OP_trunc:
+        bits = insn->sz * 8;
+        z = kb_zeros(insn->rs1);
+        s = kb_signs(insn->rs1);
+        if (bits >= 32 || z >= 32 - bits) {
+            insn->opcode = OP_assign;
+            insn->sz = 0;
+        } else {
+            z = 32 - bits;
+            s = z;
+        }
+        break;
+    case OP_sign_ext:
+        /* source size in the upper 16 bits */
+        bits = (insn->sz >> 16) * 8;
+        z = kb_zeros(insn->rs1);
+        s = kb_signs(insn->rs1);
+        read = bits == 8 ? kb_byte_read(insn->rs1) : NULL;
+        if (bits >= 32 || s >= 33 - bits) {
+            insn->opcode = OP_assign;
+            insn->sz = 0;
+        } else if (read) {
+            read->sz = -1;
+            insn->opcode = OP_assign;
+            insn->sz = 0;
+            z = 0;
+            s = 25;
+        } else {
+            z = 0;
+            s = 33 - bits;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (z > 32)
+        z = 32;
+    if (s < z)
+        s = z;
+    if (s > 32)
+        s = 32;
+    zeros[0] = z;
+    signs[0] = s;
+}
+
+/* Mark the variables 'insn' reads or writes as not yet analyzed */
+void kb_reset(insn_t *insn)
+{
+    if (insn->rd) {
+        insn->rd->known_zeros = -1;
+        insn->rd->known_signs = 0;
+        insn->rd->use_count = 0;
+    }
+    if (insn->rs1) {
+        insn->rs1->known_zeros = -1;
+        insn->rs1->use_count = 0;
+    }
+    if (insn->rs2) {
+        insn->rs2->known_zeros = -1;
+        insn->rs2->use_count = 0;
+    }
+    for (phi_operand_t *op = insn->phi_ops; op; op = op->next) {
+        if (op->var) {
+            op->var->known_zeros = -1;
+            op->var->use_count = 0;
+        }
+    }
+}
+
+/* Count the assignment and uses of the variables of 'insn' */
+void kb_count(insn_t *insn)
+{
+    if (insn->rd) {
+        insn->rd->known_signs++;
+        insn->rd->last_assign = insn;
+    }
+    if (insn->rs1)
+        insn->rs1->use_count++;
+    if (insn->rs2)
+        insn->rs2->use_count++;
+    for (phi_operand_t *op = insn->phi_ops; op; op = op->next) {
+        if (op->var)
+            op->var->use_count++;
+    }
+}
+
+/* Drop the extensions and masks of 'func' that known bits prove redundant */
+void known_bits(func_t *func)
+{
+    int zeros, signs;
+
+    for (basic_block_t *bb = func->bbs; bb; bb = bb->rpo_next) {
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next)
+            kb_reset(insn);
+    }
+
+    /* count the assignments of each variable in 'known_signs' */
+    for (basic_block_t *bb = func->bbs; bb; bb = bb->rpo_next) {
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next)
+            kb_count(insn);
+    }
+
+    for (basic_block_t *bb = func->bbs; bb; bb = bb->rpo_next) {
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
+            if (!insn->rd || insn->rd->known_signs != 1 ||
+                insn->rd->known_zeros >= 0)
+                continue;
+            kb_eval(insn, &zeros, &signs);
+            insn->rd->known_zeros = zeros;
+            insn->rd->known_signs = signs;
+        }
+    }
+}
@@ -31,6 +31,10 @@ int label_idx = 0;
 basic_block_t *backpatch_bb[MAX_LABELS];
 int backpatch_bb_idx = 0;
 
+/* case labels of the switch statements being parsed */
+case_range_t case_ranges[MAX_CASES];
+int case_ranges_idx = 0;
+
 /* stack of the operands of 3AC */
 var_t *operand_stack[MAX_OPERAND_STACK_SIZE];
 int operand_stack_idx = 0;
@@ -91,6 +95,7 @@ var_t *require_var(block_t *blk)
     var_list->elements[var_list->size++] = var;
     var->consumed = -1;
     var->phys_reg = -1;
+    var->reg_hint = -1;
     var->first_use = -1;
     var->last_use = -1;
     var->loop_depth = 0;
@@ -661,6 +666,257 @@ basic_block_t *handle_while_statement(block_t *parent, basic_block_t *bb)
     return else_;
 }
 
+/* Test 'value op case_val' at the end of 'bb' and branch on the result */
+void switch_emit_test(block_t *parent,
+                      basic_block_t *bb,
+                      var_t *value,
+                      opcode_t op,
+                      int case_val,
+                      basic_block_t *then_,
+                      basic_block_t *else_)
+{
+    var_t *imm = require_var(parent);
+    gen_name_to(imm->var_name);
+    imm->init_val = case_val;
+    add_insn(parent, bb, OP_load_constant, imm, NULL, NULL, 0, NULL);
+
+    var_t *cond = require_var(parent);
+    gen_name_to(cond->var_name);
+    add_insn(parent, bb, op, cond, value, imm, 0, NULL);
+    add_insn(parent, bb, OP_branch, NULL, cond, NULL, 0, NULL);
+
+    bb_connect(bb, then_, THEN);
+    bb_connect(bb, else_, ELSE);
+}
+
+/* Test the case ranges l..r one after another. 'above_lo' tells whether the
+ * value is known to be at least the low bound of range l, 'below_hi' whether
+ * it is known to be at most the high bound of range r.
+ */
+void switch_emit_chain(block_t *parent,
+                       basic_block_t *bb,
+                       var_t *value,
+                       int l,
+                       int r,
+                       bool above_lo,
+                       bool below_hi,
+                       basic_block_t *default_)
+{
+    for (int i = l; i <= r; i++) {
+        case_range_t *range = &case_ranges[i];
+        basic_block_t *miss = default_;
+
+        if (i < r)
+            miss = bb_create(parent);
+
+        if (above_lo && below_hi && i == r)
+            bb_connect(bb, range->bb, NEXT);
+        else if (above_lo)
+            switch_emit_test(parent, bb, value, OP_leq, range->hi, range->bb,
+                             miss);
+        else if (below_hi && i == r)
+            switch_emit_test(parent, bb, value, OP_geq, range->lo, range->bb,
+                             miss);
+        else if (range->lo == range->hi)
+            switch_emit_test(parent, bb, value, OP_eq, range->lo, range->bb,
+                             miss);
+        else {
+            basic_block_t *n = bb_create(parent);
+            switch_emit_test(parent, bb, value, OP_geq, range->lo, n, miss);
+            switch_emit_test(parent, n, value, OP_leq, range->hi, range->bb,
+                             miss);
+        }
+
+        /* a value above this range may only start the next one */
+        above_lo = above_lo && i < r && case_ranges[i + 1].lo == range->hi + 1;
+        bb = miss;
+    }
+}
+
+/* Dispatch over the sorted case ranges l..r of the table first..last with a
+ * balanced tree of comparisons, ending in short chains.
+ */
+void switch_emit_tree(block_t *parent,
+                      basic_block_t *bb,
+                      var_t *value,
+                      int l,
+                      int r,
+                      int first,
+                      int last,
+                      basic_block_t *default_)
+{
+    if (r - l < 3) {
+        bool above_lo = l > first, below_hi = false;
+
+        /* the bounds come from the splits on the way down */
+        if (r < last)
+            below_hi = case_ranges[r + 1].lo == case_ranges[r].hi + 1;
+        switch_emit_chain(parent, bb, value, l, r, above_lo, below_hi,
+                          default_);
+        return;
+    }
+
+    int mid = (l + r + 1) / 2;
+    basic_block_t *below = bb_create(parent);
+    basic_block_t *above = bb_create(parent);
+    switch_emit_test(parent, bb, value, OP_lt, case_ranges[mid].lo, below,
+                     above);
+    switch_emit_tree(parent, below, value, l, mid - 1, first, last, default_);
+    switch_emit_tree(parent, above, value, mid, r, first, last, default_);
+}
+
+/* The case labels are collected while the bodies are parsed, and the
+ * dispatch is built afterwards from the sorted table. Consecutive values
+ * with the same body form a range, so that clusters of labels cost at most
+ * two comparisons, and the ranges are searched as a balanced tree.
+ */
+basic_block_t *handle_switch_statement(block_t *parent, basic_block_t *bb)
+{
+    char token[MAX_ID_LEN];
+    basic_block_t *default_ = NULL;
+    int first = case_ranges_idx;
+
+    basic_block_t *n = bb_create(parent);
+    bb_connect(bb, n, NEXT);
+    bb = n;
+
+    lex_expect(T_open_bracket);
+    read_expr(parent, &bb);
+    lex_expect(T_close_bracket);
+    var_t *value = opstack_pop();
+
+    /* create exit jump for breaks */
+    basic_block_t *switch_end = bb_create(parent);
+    break_bb[break_exit_idx++] = switch_end;
+    basic_block_t *true_body_ = bb_create(parent);
+
+    lex_expect(T_open_curly);
+    while (lex_peek(T_default, NULL) || lex_peek(T_case, NULL)) {
+        if (lex_accept(T_default)) {
+            if (default_)
+                error_at("Multiple default labels", next_token_loc());
+            default_ = true_body_;
+        } else {
+            int case_val;
+
+            lex_accept(T_case);
+            if (lex_peek(T_numeric, token)) {
+                case_val = parse_numeric_constant(token);
+                lex_expect(T_numeric);
+            } else if (lex_peek(T_char, token)) {
+                char unescaped[MAX_TOKEN_LEN];
+                unescape_string(token, unescaped, MAX_TOKEN_LEN);
+                case_val = unescaped[0];
+                lex_expect(T_char);
+            } else if (lex_peek(T_identifier, token)) {
+                constant_t *cd = find_constant(token);
+                case_val = cd->value;
+                lex_expect(T_identifier);
+            } else {
+                fatal("Not a valid case value");
+            }
+
+            if (case_ranges_idx == MAX_CASES)
+                fatal("Too many case labels");
+            case_ranges[case_ranges_idx].lo = case_val;
+            case_ranges[case_ranges_idx].hi = case_val;
+            case_ranges[case_ranges_idx].bb = true_body_;
+            case_ranges_idx++;
+        }
+        lex_expect(T_colon);
+
+        int control = 0;
+
+        while (!lex_peek(T_case, NULL) && !lex_peek(T_close_curly, NULL) &&
+               !lex_peek(T_default, NULL)) {
+            true_body_ = read_body_statement(parent, true_body_);
+            control = 1;
+        }
+
+        if (control && true_body_) {
+            /* Create a new body block for next case, and connect the last
+             * body block which lacks 'break' to it to make that one ignore
+             * the upcoming cases.
+             */
+            n = bb_create(parent);
+            bb_connect(true_body_, n, NEXT);
+            true_body_ = n;
+        }
+
+        /* create a new body block for next case if the last body block exits
+         * 'switch'.
+         */
+        if (!lex_peek(T_close_curly, NULL) && !true_body_)
+            true_body_ = bb_create(parent);
+    }
+    lex_expect(T_close_curly);
+
+    if (true_body_)
+        /* if the last label has no explicit break, connect it to the end */
+        bb_connect(true_body_, switch_end, NEXT);
+
+    break_exit_idx--;
+
+    /* handle missing default label */
+    if (!default_)
+        default_ = switch_end;
+
+    /* Sort the labels by value. Those sharing the body of the default label
+     * need no test.
+     */
+    int last = first;
+    for (int i = first; i < case_ranges_idx; i++) {
+        basic_block_t *body = case_ranges[i].bb;
+        int case_val = case_ranges[i].lo, j = last;
+
+        if (body == default_)
+            continue;
+        while (j > first && case_ranges[j - 1].lo > case_val) {
+            case_ranges[j].lo = case_ranges[j - 1].lo;
+            case_ranges[j].bb = case_ranges[j - 1].bb;
+            j--;
+        }
+        if (j > first && case_ranges[j - 1].lo == case_val)
+            error_at("Duplicate case value", next_token_loc());
+        case_ranges[j].lo = case_val;
+        case_ranges[j].bb = body;
+        last++;
+    }
+
+    /* merge runs of consecutive values into ranges */
+    int count = first;
+    for (int i = first; i < last; i++) {
+        case_range_t *range = &case_ranges[i];
+
+        if (count > first && case_ranges[count - 1].bb == range->bb &&
+            case_ranges[count - 1].hi + 1 == range->lo) {
+            case_ranges[count - 1].hi = range->lo;
+            continue;
+        }
+        case_ranges[count].lo = range->lo;
+        case_ranges[count].hi = range->lo;
+        case_ranges[count].bb = range->bb;
+        count++;
+    }
+
+    if (count == first)
+        bb_connect(bb, default_, NEXT);
+    else
+        switch_emit_tree(parent, bb, value, first, count - 1, first, count - 1,
+                         default_);
+    case_ranges_idx = first;
+
+    int dangling = 1;
+    for (int i = 0; i < MAX_BB_PRED; i++)
+        if (switch_end->prev[i].bb)
+            dangling = 0;
+
+    if (dangling)
+        return NULL;
+
+    return switch_end;
+}
+
 basic_block_t *handle_goto_statement(block_t *parent, basic_block_t *bb)
 {
     /* Since a goto splits the current program into two basic blocks and makes
@@ -3753,7 +4009,7 @@ basic_block_t *read_body_statement(block_t *parent, basic_block_t *bb)
     char token[MAX_ID_LEN];
     func_t *func;
     type_t *type;
-    var_t *vd, *rs1, *rs2, *var;
+    var_t *vd, *rs1, *var;
     opcode_t prefix_op = OP_generic;
     bool is_const = false;
 
@@ -3781,125 +4037,7 @@ basic_block_t *read_body_statement(block_t *parent, basic_block_t *bb)
     }
 
     if (lex_accept(T_switch)) {
-        bool is_default = false;
-
-        basic_block_t *n = bb_create(parent);
-        bb_connect(bb, n, NEXT);
-        bb = n;
-
-        lex_expect(T_open_bracket);
-        read_expr(parent, &bb);
-        lex_expect(T_close_bracket);
-
-        /* create exit jump for breaks */
-        basic_block_t *switch_end = bb_create(parent);
-        break_bb[break_exit_idx++] = switch_end;
-        basic_block_t *true_body_ = bb_create(parent);
-
-        lex_expect(T_open_curly);
-        while (lex_peek(T_default, NULL) || lex_peek(T_case, NULL)) {
-            if (lex_accept(T_default))
-                is_default = true;
-            else {
-                int case_val;
-
-                lex_accept(T_case);
-                if (lex_peek(T_numeric, token)) {
-                    case_val = parse_numeric_constant(token);
-                    lex_expect(T_numeric);
-                } else if (lex_peek(T_char, token)) {
-                    char unescaped[MAX_TOKEN_LEN];
-                    unescape_string(token, unescaped, MAX_TOKEN_LEN);
-                    case_val = unescaped[0];
-                    lex_expect(T_char);
-                } else if (lex_peek(T_identifier, token)) {
-                    constant_t *cd = find_constant(token);
-                    case_val = cd->value;
-                    lex_expect(T_identifier);
-                } else {
-                    fatal("Not a valid case value");
-                }
-
-                vd = require_var(parent);
-                gen_name_to(vd->var_name);
-                vd->init_val = case_val;
-                opstack_push(vd);
-                add_insn(parent, bb, OP_load_constant, vd, NULL, NULL, 0, NULL);
-
-                vd = require_var(parent);
-                gen_name_to(vd->var_name);
-                rs1 = opstack_pop();
-                rs2 = operand_stack[operand_stack_idx - 1];
-                add_insn(parent, bb, OP_eq, vd, rs1, rs2, 0, NULL);
-
-                add_insn(parent, bb, OP_branch, NULL, vd, NULL, 0, NULL);
-            }
-            lex_expect(T_colon);
-
-            if (is_default)
-                /* there's no condition if it is a default label */
-                bb_connect(bb, true_body_, NEXT);
-            else
-                bb_connect(bb, true_body_, THEN);
-
-            int control = 0;
-
-            while (!lex_peek(T_case, NULL) && !lex_peek(T_close_curly, NULL) &&
-                   !lex_peek(T_default, NULL)) {
-                true_body_ = read_body_statement(parent, true_body_);
-                control = 1;
-            }
-
-            if (control && true_body_) {
-                /* Create a new body block for next case, and connect the last
-                 * body block which lacks 'break' to it to make that one ignore
-                 * the upcoming cases.
-                 */
-                n = bb_create(parent);
-                bb_connect(true_body_, n, NEXT);
-                true_body_ = n;
-            }
-
-            if (!lex_peek(T_close_curly, NULL)) {
-                if (is_default)
-                    error_at("Label default should be the last one",
-                             next_token_loc());
-
-                /* create a new conditional block for next case */
-                n = bb_create(parent);
-                bb_connect(bb, n, ELSE);
-                bb = n;
-
-                /* create a new body block for next case if the last body block
-                 * exits 'switch'.
-                 */
-                if (!true_body_)
-                    true_body_ = bb_create(parent);
-            } else if (!is_default) {
-                /* handle missing default label */
-                bb_connect(bb, switch_end, ELSE);
-            }
-        }
-
-        /* remove the expression in switch() */
-        opstack_pop();
-        lex_expect(T_close_curly);
-
-        if (true_body_)
-            /* if the last label has no explicit break, connect it to the end */
-            bb_connect(true_body_, switch_end, NEXT);
-
-        break_exit_idx--;
-
-        int dangling = 1;
-        for (int i = 0; i < MAX_BB_PRED; i++)
-            if (switch_end->prev[i].bb)
-                dangling = 0;
-
-        if (dangling)
-            return NULL;
-
-        return switch_end;
+        return handle_switch_statement(parent, bb);
     }
 
     if (lex_accept(T_break)) {
@@ -21,6 +21,9 @@ bool is_fusible_insn(ph2_ir_t *ph2_ir)
     case OP_mul:
     case OP_div:
     case OP_mod:
+    case OP_div_const:
+    case OP_mod_const:
+    case OP_mul_const:
     case OP_lshift: /* Shift operations */
     case OP_rshift:
     case OP_bit_and: /* Bitwise operations */
@@ -368,6 +371,7 @@ bool eliminate_load_store_pairs(ph2_ir_t *ph2_ir)
     if (ph2_ir->op == OP_store && next->op == OP_store) {
         /* Check if storing to same memory location */
         if (ph2_ir->src0 == next->src0 && ph2_ir->src1 == next->src1 &&
+            ph2_ir->ofs_based_on_stack_top == next->ofs_based_on_stack_top &&
             ph2_ir->src0 >= 0 && ph2_ir->src1 >= 0) {
             /* Remove first store - it's dead */
             ph2_ir->dest = next->dest;
@@ -384,6 +388,7 @@ bool eliminate_load_store_pairs(ph2_ir_t *ph2_ir)
     if (ph2_ir->op == OP_load && next->op == OP_load) {
         /* Check if loading from same memory location */
         if (ph2_ir->src0 == next->src0 && ph2_ir->src1 == next->src1 &&
+            ph2_ir->ofs_based_on_stack_top == next->ofs_based_on_stack_top &&
             ph2_ir->src0 >= 0 && ph2_ir->src1 >= 0) {
             /* Replace second load with move */
             next->op = OP_assign;
@@ -399,11 +404,12 @@ bool eliminate_load_store_pairs(ph2_ir_t *ph2_ir)
      */
     if (ph2_ir->op == OP_store && next->op == OP_load) {
         /* Check if accessing same memory location */
-        if (ph2_ir->src0 == next->src0 && ph2_ir->src1 == next->src1 &&
-            ph2_ir->src0 >= 0 && ph2_ir->dest >= 0) {
+        if (ph2_ir->src1 == next->src0 &&
+            ph2_ir->ofs_based_on_stack_top == next->ofs_based_on_stack_top &&
+            ph2_ir->src0 >= 0) {
             /* Replace load with move of stored value */
             next->op = OP_assign;
-            next->src0 = ph2_ir->dest; /* Value that was stored */
+            next->src0 = ph2_ir->src0; /* Value that was stored */
             next->src1 = 0;
             return true;
         }
@@ -415,8 +421,9 @@ bool eliminate_load_store_pairs(ph2_ir_t *ph2_ir)
      */
     if (ph2_ir->op == OP_load && next->op == OP_store) {
         /* Check if storing the value we just loaded from same location */
-        if (ph2_ir->dest == next->dest && ph2_ir->src0 == next->src0 &&
-            ph2_ir->src1 == next->src1 && ph2_ir->src0 >= 0) {
+        if (ph2_ir->dest == next->src0 && ph2_ir->src0 == next->src1 &&
+            ph2_ir->ofs_based_on_stack_top == next->ofs_based_on_stack_top &&
+            ph2_ir->src0 >= 0) {
             /* Remove redundant store */
             ph2_ir->next = next->next;
             return true;
@@ -519,8 +526,202 @@ bool algebraic_simplification(ph2_ir_t *ph2_ir)
     return false;
 }
 
-/* Division/modulo strength reduction: Optimize division and modulo by
- * power-of-2
+/* Shift amount of the power of two 'value', or -1 if it is none */
+int pow2_shift(int value)
+{
+    int shift = 0;
+
+    if (value <= 0 || (value & (value - 1)))
+        return -1;
+    while (value > 1) {
+        value >>= 1;
+        shift++;
+    }
+    return shift;
+}
+
+/* Whether division and modulo by the constant 'divisor' are expanded by the
+ * backends instead of dividing. Divisors of magnitude one are folded by SSA.
+ */
+bool is_cheap_divisor(int divisor)
+{
+    return divisor > -1073741824 && divisor < 1073741824 &&
+           (divisor < -1 || divisor > 1);
+}
+
+/* Low word of 2^(32 + shift) / divisor, with the remainder in 'rem'. The
+ * long division doubles the remainder without overflowing.
+ */
+int div_reciprocal(int divisor, int shift, int *rem)
+{
+    int q = 0, r = 1;
+
+    for (int i = 0; i < 32 + shift; i++) {
+        if (r >= divisor - r) {
+            r -= divisor - r;
+            q = (q << 1) | 1;
+        } else {
+            r += r;
+            q = q << 1;
+        }
+    }
+    rem[0] = r;
+    return q;
+}
+
+/* Multiplier and shift for signed division by a positive 'divisor' that is
+ * not a power of two, after Granlund and Montgomery: the quotient of x is the
+ * high word of x * magic, plus x when the multiplier reads as negative,
+ * shifted right by 'shift' and plus one when x is negative.
+ */
+void div_magic(int divisor, int *magic, int *shift)
+{
+    int rem, s = 0;
+    int q = div_reciprocal(divisor, 0, &rem);
+
+    /* the smallest shift whose rounding error stays below 2^(s + 1) */
+    while (divisor - rem > (2 << s)) {
+        s++;
+        q = div_reciprocal(divisor, s, &rem);
+    }
+    magic[0] = q + 1;
+    shift[0] = s;
+}
+
+/* Instructions the target spends on a step of a multiplication by a constant.
+ * ARM shifts the second operand of an addition for free.
+ */
+int mul_step_cost(int step)
+{
+#if ELF_MACHINE == 0x28 /* ARM */
+    return 1;
+#else
+    return (step >> 5) == MUL_SHIFT || (step >> 5) == MUL_NEGATE ? 1 : 2;
+#endif
+}
+
+/* Instructions that may be spent on a multiplication by the constant 'value'
+ * before loading it and multiplying is cheaper. A hardware multiplication
+ * counts twice for its latency, while the software one loops up to 32 times
+ * over a 13 instruction body.
+ */
+int mul_const_budget(int value)
+{
+    int load = 1;
+
+#if ELF_MACHINE == 0x28 /* ARM */
+    if (value < 0)
+        load = 3;
+    else if (value > 255)
+        load = 2;
+#else
+    if (value < -2048 || value > 2047)
+        load = 2;
+    if (!hard_mul_div)
+        return load + 13;
+#endif
+    return load + 2;
+}
+
+/* Append a step to 'plan' */
+void mul_plan_add(int *plan, mul_step_t kind, int shift)
+{
+    plan[0]++;
+    plan[plan[0]] = (kind << 5) | shift;
+}
+
+/* Cheapest steps multiplying by the positive 'value' into 'plan', see
+ * mul_const_plan(). Returns their cost, or -1 if it exceeds 'budget'.
+ */
+int mul_plan(int value, int budget, int *plan)
+{
+    int cand[MAX_MUL_STEPS];
+    int best = -1, cost, u, k, step;
+
+    plan[0] = 0;
+    if (budget < 0)
+        return -1;
+    if (value == 1)
+        return 0;
+
+    /* p = x * (value >> k), then shift */
+    if (!(value & 1)) {
+        k = 0;
+        while (!((value >> k) & 1))
+            k++;
+        step = (MUL_SHIFT << 5) | k;
+        cost = mul_plan(value >> k, budget - mul_step_cost(step), plan);
+        if (cost < 0)
+            return -1;
+        mul_plan_add(plan, MUL_SHIFT, k);
+        return cost + mul_step_cost(step);
+    }
+
+    /* one digit of the non-adjacent form: value = (u << k) +/- 1 */
+    if ((value & 2) && value != 2147483647) {
+        u = value + 1;
+        step = MUL_SUB_X << 5;
+    } else {
+        u = value - 1;
+        step = MUL_ADD_X << 5;
+    }
+    k = 0;
+    while (!((u >> k) & 1))
+        k++;
+    step |= k;
+    cost = mul_plan(u >> k, budget - mul_step_cost(step), plan);
+    if (cost >= 0) {
+        mul_plan_add(plan, step >> 5, k);
+        best = cost + mul_step_cost(step);
+        budget = best - 1;
+    }
+
+    /* a factor of the form (1 << k) +/- 1 */
+    for (k = 1; k < 31 && (1 << k) - 1 <= value; k++) {
+        for (int kind = MUL_ADD_P; kind <= MUL_SUB_P; kind++) {
+            int factor = kind == MUL_ADD_P ? (1 << k) + 1 : (1 << k) - 1;
+
+            if (factor < 3 || value % factor)
+                continue;
+            step = (kind << 5) | k;
+            cost = mul_plan(value / factor, budget - mul_step_cost(step),
+                            cand);
+            if (cost < 0)
+                continue;
+            mul_plan_add(cand, kind, k);
+            best = cost + mul_step_cost(step);
+            budget = best - 1;
+            for (int i = 0; i <= cand[0]; i++)
+                plan[i] = cand[i];
+        }
+    }
+    return best;
+}
+
+/* Shifts, additions and subtractions multiplying by the constant 'value'
+ * within the budget of the target, see mul_const_budget(). 'plan' receives
+ * their count followed by the steps, each a mul_step_t shifted left by 5 plus
+ * its shift amount. Returns the cost of the steps, or -1 if there are none.
+ */
+int mul_const_plan(int value, int *plan)
+{
+    int budget = mul_const_budget(value), cost;
+
+    if (value == -2147483647 - 1)
+        return -1;
+    if (value > 0)
+        return mul_plan(value, budget, plan);
+
+    cost = mul_plan(-value, budget - 1, plan);
+    if (cost < 0)
+        return -1;
+    mul_plan_add(plan, MUL_NEGATE, 0);
+    return cost + 1;
+}
+
+/* Strength reduction: Fold a constant divisor into its division and modulo,
+ * turn multiplication by power-of-2 into a shift and fold other constant
+ * factors that shifts and additions multiply by cheaply
  *
  * This pattern is unique to peephole optimizer.
  * SSA cannot perform this optimization because it works on virtual registers
@@ -535,48 +736,39 @@ bool strength_reduction(ph2_ir_t *ph2_ir)
 
     ph2_ir_t *next = ph2_ir->next;
 
-    /* Check for constant load followed by division or modulo */
+    /* Check for constant load followed by an arithmetic operation */
     if (ph2_ir->op != OP_load_constant)
         return false;
 
     int value = ph2_ir->src0;
 
-    /* Check if value is a power of 2 */
-    if (value <= 0 || (value & (value - 1)) != 0)
-        return false;
-
-    /* Calculate shift amount for power of 2 */
-    int shift = 0;
-    int tmp = value;
-    while (tmp > 1) {
-        shift++;
-        tmp >>= 1;
-    }
-
-    /* Pattern 1: Division by power of 2 → right shift
-     * x / 2^n = x >> n (for unsigned)
+    /* Pattern 1: Division or modulo by a constant → OP_div_const/OP_mod_const
+     * The backends expand these into shifts for powers of 2 and into a
+     * multiplication by the reciprocal otherwise. The constant register only
+     * feeds this instruction, see ra_fresh_const().
      */
-    if (next->op == OP_div && next->src1 == ph2_ir->dest) {
-        /* Convert division to right shift */
-        ph2_ir->src0 = shift; /* Load shift amount instead */
-        next->op = OP_rshift;
+    if ((next->op == OP_div || next->op == OP_mod) &&
+        next->src1 == ph2_ir->dest && next->src0 != ph2_ir->dest &&
+        is_cheap_divisor(value)) {
+        if (next->op == OP_div)
+            ph2_ir->op = OP_div_const;
+        else
+            ph2_ir->op = OP_mod_const;
+        ph2_ir->src0 = next->src0;
+        ph2_ir->src1 = value;
+        ph2_ir->dest = next->dest;
+        ph2_ir->next = next->next;
         return true;
     }
 
-    /* Pattern 2: Modulo by power of 2 → bitwise AND
-     * x % 2^n = x & (2^n - 1)
-     */
-    if (next->op == OP_mod && next->src1 == ph2_ir->dest) {
-        /* Convert modulo to bitwise AND */
-        ph2_ir->src0 = value - 1; /* Load mask (2^n - 1) */
-        next->op = OP_bit_and;
-        return true;
-    }
+    if (next->op != OP_mul || next->src0 == next->src1)
+        return false;
 
-    /* Pattern 3: Multiplication by power of 2 → left shift
+    /* Pattern 2: Multiplication by power of 2 → left shift
      * x * 2^n = x << n
      */
-    if (next->op == OP_mul) {
+    int shift = pow2_shift(value);
+    if (shift >= 0) {
         if (next->src0 == ph2_ir->dest) {
             /* 2^n * x = x << n */
             ph2_ir->src0 = shift; /* Load shift amount */
@@ -590,9 +782,27 @@ bool strength_reduction(ph2_ir_t *ph2_ir)
             next->op = OP_lshift;
             return true;
         }
+        return false;
     }
 
-    return false;
+    /* Pattern 3: Multiplication by another constant → OP_mul_const
+     * The backends expand it into the shifts, additions and subtractions of
+     * mul_const_plan() when these beat loading the constant and multiplying.
+     */
+    int plan[MAX_MUL_STEPS];
+    if ((value >= -1 && value <= 1) || mul_const_plan(value, plan) < 0)
+        return false;
+    if (next->src0 == ph2_ir->dest)
+        ph2_ir->src0 = next->src1;
+    else if (next->src1 == ph2_ir->dest)
+        ph2_ir->src0 = next->src0;
+    else
+        return false;
+    ph2_ir->op = OP_mul_const;
+    ph2_ir->src1 = value;
+    ph2_ir->dest = next->dest;
+    ph2_ir->next = next->next;
+    return true;
 }
 
 /* Comparison optimization: Simplify comparison patterns
@@ -701,7 +911,6 @@ bool bitwise_optimization(ph2_ir_t *ph2_ir)
         /* Replace AND with assignment */
         next->op = OP_assign;
         next->src1 = 0;
-        ph2_ir->next = next->next;
         return true;
     }
 
@@ -713,7 +922,6 @@ bool bitwise_optimization(ph2_ir_t *ph2_ir)
         /* Replace OR with assignment */
         next->op = OP_assign;
         next->src1 = 0;
-        ph2_ir->next = next->next;
         return true;
     }
 
@@ -725,7 +933,6 @@ bool bitwise_optimization(ph2_ir_t *ph2_ir)
         /* Replace XOR with assignment */
         next->op = OP_assign;
         next->src1 = 0;
-        ph2_ir->next = next->next;
         return true;
     }
 
@@ -736,9 +943,7 @@ bool bitwise_optimization(ph2_ir_t *ph2_ir)
         next->op == OP_bit_and &&
         (next->src0 == ph2_ir->dest || next->src1 == ph2_ir->dest)) {
         /* Replace with constant load of 0 */
-        next->op = OP_load_constant;
-        next->src0 = 0;
-        next->src1 = 0;
+        ph2_ir->dest = next->dest;
         ph2_ir->next = next->next;
         return true;
     }
@@ -750,9 +955,7 @@ bool bitwise_optimization(ph2_ir_t *ph2_ir)
         next->op == OP_bit_or &&
         (next->src0 == ph2_ir->dest || next->src1 == ph2_ir->dest)) {
         /* Replace with constant load of -1 */
-        next->op = OP_load_constant;
-        next->src0 = -1;
-        next->src1 = 0;
+        ph2_ir->dest = next->dest;
         ph2_ir->next = next->next;
         return true;
     }
@@ -766,7 +969,6 @@ bool bitwise_optimization(ph2_ir_t *ph2_ir)
         /* Replace shift with assignment */
         next->op = OP_assign;
         next->src1 = 0;
-        ph2_ir->next = next->next;
         return true;
     }
 
@@ -787,20 +989,19 @@ bool triple_pattern_optimization(ph2_ir_t *ph2_ir)
 
     /* Pattern 1: Store-load-store elimination
      * {store val1, addr; load r, addr; store val2, addr}
-     * The middle load is pointless if not used elsewhere
+     * The first store is dead; the load becomes a move of val1
      */
     if (ph2_ir->op == OP_store && second->op == OP_load &&
-        third->op == OP_store &&
-        ph2_ir->src1 == second->src0 && /* same address */
-        ph2_ir->dest == second->src1 && /* same offset */
-        second->src0 == third->src1 &&  /* same address */
-        second->src1 == third->dest) {  /* same offset */
-        /* Check if the loaded value is used by the third store */
-        if (third->src0 != second->dest) {
-            /* The load result is not used, can eliminate it */
-            ph2_ir->next = third;
-            return true;
-        }
+        third->op == OP_store && ph2_ir->src1 == second->src0 &&
+        second->src0 == third->src1 &&
+        ph2_ir->ofs_based_on_stack_top == second->ofs_based_on_stack_top &&
+        second->ofs_based_on_stack_top == third->ofs_based_on_stack_top) {
+        ph2_ir->op = OP_assign;
+        ph2_ir->dest = second->dest;
+        ph2_ir->src1 = 0;
+        ph2_ir->ofs_based_on_stack_top = false;
+        ph2_ir->next = third;
+        return true;
     }
 
     /* Pattern 2: Consecutive stores to same location
@@ -809,8 +1010,9 @@ bool triple_pattern_optimization(ph2_ir_t *ph2_ir)
      */
     if (ph2_ir->op == OP_store && second->op == OP_store &&
         third->op == OP_store && ph2_ir->src1 == second->src1 &&
-        ph2_ir->dest == second->dest && second->src1 == third->src1 &&
-        second->dest == third->dest) {
+        second->src1 == third->src1 &&
+        ph2_ir->ofs_based_on_stack_top == second->ofs_based_on_stack_top &&
+        second->ofs_based_on_stack_top == third->ofs_based_on_stack_top) {
         /* All three stores go to the same location */
         /* Only the last one matters, eliminate first two */
         ph2_ir->src0 = third->src0; /* Use last value */
@@ -911,7 +1113,7 @@ void peephole(void)
                 if (comparison_optimization(ir))
                     continue;
 
-                /* Apply strength reduction for power-of-2 operations */
+                /* Apply strength reduction for constant operands */
                 if (strength_reduction(ir))
                     continue;
 
@@ -6,10 +6,12 @@
  */
 
 /* Allocate registers from IR. The linear-scan algorithm now expects a minimum
- * of 7 available registers (typical for RISC-style architectures).
+ * of 7 available registers (typical for RISC-style architectures), plus the
+ * two scratch registers REG_SCRATCH0 and REG_SCRATCH1 outside of the pool.
+ * Values living across calls are placed in the callee-saved registers of
+ * REG_CALLEE_SAVED when possible; others must be spilled around the calls.
  *
- * TODO: Implement "-O level" optimization control. Currently the allocator
- * always performs dead variable elimination without writing back to stack.
+ * TODO: Implement "-O level" optimization control.
  */
 #include "defs.h"
 #include "globals.c"
@@ -53,34 +55,6 @@ bool check_live_out(basic_block_t *bb, var_t *var)
     return false;
 }
 
-void track_var_use(var_t *var, int insn_idx)
-{
-    if (!var)
-        return;
-
-    var->use_count++;
-
-    if (var->first_use < 0)
-        var->first_use = insn_idx;
-
-    var->last_use = insn_idx;
-}
-
-void refresh(basic_block_t *bb, insn_t *insn)
-{
-    for (int i = 0; i < REG_CNT; i++) {
-        if (!REGS[i].var)
-            continue;
-        if (check_live_out(bb, REGS[i].var))
-            continue;
-        if (REGS[i].var->consumed < insn->idx) {
-            vreg_clear_phys(REGS[i].var);
-            REGS[i].var = NULL;
-            REGS[i].polluted = 0;
-        }
-    }
-}
-
 ph2_ir_t *bb_add_ph2_ir(basic_block_t *bb, opcode_t op)
 {
     ph2_ir_t *n = arena_alloc(BB_ARENA, sizeof(ph2_ir_t));
@@ -88,6 +62,7 @@ ph2_ir_t *bb_add_ph2_ir(basic_block_t *bb, opcode_t op)
     /* Initialize all fields explicitly */
     n->next = NULL;            /* well-formed singly linked list */
     n->is_branch_detached = 0; /* arch-lowering will set for branches */
+    n->branch_cmp = OP_generic;
     n->src0 = 0;
     n->src1 = 0;
     n->dest = 0;
@@ -96,6 +71,7 @@ ph2_ir_t *bb_add_ph2_ir(basic_block_t *bb, opcode_t op)
     n->then_bb = NULL;
     n->else_bb = NULL;
     n->ofs_based_on_stack_top = false;
+    n->calls_runtime_helper = false;
 
     if (!bb->ph2_ir_list.head)
         bb->ph2_ir_list.head = n;
@@ -335,87 +311,1162 @@ int prepare_dest(basic_block_t *bb, var_t *var, int operand_0, int operand_1)
     return spilled;
 }
 
-void spill_alive(basic_block_t *bb, insn_t *insn)
+/* Function-wide linear-scan allocation.
+ *
+ * Instructions are numbered in reverse post-order and every value gets a
+ * single live interval, stretched over the blocks where it is live-in or
+ * live-out. Intervals take registers in order of their start points; when
+ * none is free, the interval with the lowest use density is spilled and lives
+ * in its stack slot for the whole function, going through the scratch
+ * registers at each use and definition.
+ *
+ * All registers are clobbered by calls. A value that lives across a call keeps
+ * its register but is written back at its definition, so the call only
+ * leaves it stale; it is reloaded at its next use or at the end of the block.
+ */
+
+bool is_fusible_insn(ph2_ir_t *ph2_ir);
+
+var_t *vreg_rep(var_t *var)
+{
+    if (var->vreg_id < 0)
+        return var;
+    return VREGS[var->vreg_id];
+}
+
+void ra_reset_var(var_t *var)
+{
+    if (!var)
+        return;
+
+    var->vreg_id = -1;
+    var->phys_reg = -1;
+    var->reg_hint = -1;
+    var->vreg_flags = 0;
+    var->first_use = -1;
+    var->last_use = -1;
+    var->use_count = 0;
+}
+
+/* Scalars without initializer get their storage on demand */
+bool ra_is_scalar_allocat(var_t *var)
+{
+    return (var->type == TY_void || var->type == TY_int ||
+            var->type == TY_short || var->type == TY_char ||
+            var->type == TY_bool) &&
+           var->array_size == 0;
+}
+
+bool ra_is_def(insn_t *insn)
+{
+    if (!insn->rd)
+        return false;
+
+    switch (insn->opcode) {
+    case OP_push:
+    case OP_call:
+    case OP_indirect:
+    case OP_branch:
+    case OP_return:
+    case OP_write:
+        return false;
+    case OP_allocat:
+        return !ra_is_scalar_allocat(insn->rd);
+    default:
+        return true;
+    }
+}
+
+void ra_note_def(insn_t *insn)
+{
+    var_t *var = insn->rd;
+
+    if (var->vreg_flags & VREG_DEFINED) {
+        var->vreg_flags |= VREG_MULTI_DEF;
+        var->vreg_flags = var->vreg_flags & ~VREG_REMAT;
+        return;
+    }
+
+    var->vreg_flags |= VREG_DEFINED;
+    var->last_assign = insn;
+    if (var->vreg_flags & VREG_MEMORY)
+        return;
+
+    /* A constant or an address defined once can be rematerialized instead of
+     * reloaded.
+     */
+    switch (insn->opcode) {
+    case OP_load_constant:
+    case OP_load_data_address:
+    case OP_load_rodata_address:
+    case OP_address_of:
+    case OP_global_address_of:
+        var->vreg_flags |= VREG_REMAT;
+        break;
+    default:
+        break;
+    }
+}
+
+/* Reset the allocator state of every value in 'func', mark the values that
+ * must stay in memory, and size the per-function tables.
+ */
+void ra_prepare(func_t *func)
+{
+    int cap = MAX_PARAMS;
+
+    for (int i = 0; i < func->num_params; i++)
+        ra_reset_var(func->param_defs[i].subscripts[0]);
+
+    for (basic_block_t *bb = func->bbs; bb; bb = bb->rpo_next) {
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
+            ra_reset_var(insn->rd);
+            ra_reset_var(insn->rs1);
+            ra_reset_var(insn->rs2);
+            cap += 3;
+        }
+    }
+
+    for (int i = 0; i < func->num_params; i++) {
+        var_t *param = func->param_defs[i].subscripts[0];
+
+        param->vreg_flags |= VREG_DEFINED;
+        if (func->va_args || i >= MAX_ARGS_IN_REG)
+            param->vreg_flags |= VREG_MEMORY;
+    }
+
+    for (basic_block_t *bb = func->bbs; bb; bb = bb->rpo_next) {
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
+            if (insn->rd && insn->rd->is_global)
+                insn->rd->vreg_flags |= VREG_MEMORY;
+            if (insn->rs1 && insn->rs1->is_global)
+                insn->rs1->vreg_flags |= VREG_MEMORY;
+            if (insn->rs2 && insn->rs2->is_global)
+                insn->rs2->vreg_flags |= VREG_MEMORY;
+
+            switch (insn->opcode) {
+            case OP_address_of:
+            case OP_global_address_of:
+                /* Address-taken variables may be modified via pointers */
+                insn->rs1->address_taken = true;
+                insn->rs1->is_const = false;
+                insn->rs1->vreg_flags |= VREG_MEMORY;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    for (basic_block_t *bb = func->bbs; bb; bb = bb->rpo_next) {
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
+            if (ra_is_def(insn))
+                ra_note_def(insn);
+        }
+    }
+
+    VREGS = arena_alloc(GENERAL_ARENA, cap * sizeof(var_t *));
+    STALE_VARS = arena_alloc(GENERAL_ARENA, cap * sizeof(var_t *));
+    MEM_VARS = arena_alloc(GENERAL_ARENA, cap * sizeof(var_t *));
+    PHI_TMP_SLOTS = arena_alloc(GENERAL_ARENA, cap * sizeof(int));
+    CALL_POS = arena_alloc(GENERAL_ARENA, cap * sizeof(int));
+    CALL_COST = arena_alloc(GENERAL_ARENA, (cap + 1) * sizeof(int));
+    CALL_COST[0] = 0;
+    vreg_cnt = 0;
+    call_cnt = 0;
+    stale_cnt = 0;
+    mem_cnt = 0;
+    phi_tmp_cnt = 0;
+    vreg_next = 0;
+}
+
+/* Approximate loop nesting from the back edges of the reverse post-order:
+ * the blocks between a loop header and its latch form the loop body.
+ */
+void ra_compute_loop_depth(func_t *func)
+{
+    for (basic_block_t *bb = func->bbs; bb; bb = bb->rpo_next)
+        bb->loop_depth = 0;
+
+    for (basic_block_t *bb = func->bbs; bb; bb = bb->rpo_next) {
+        basic_block_t *succs[3];
+        succs[0] = bb->next;
+        succs[1] = bb->then_;
+        succs[2] = bb->else_;
+
+        for (int i = 0; i < 3; i++) {
+            if (!succs[i] || succs[i]->rpo > bb->rpo)
+                continue;
+            for (basic_block_t *b = succs[i]; b; b = b->rpo_next) {
+                b->loop_depth++;
+                if (b == bb)
+                    break;
+            }
+        }
+    }
+}
+
+/* Extend the interval of 'var' to 'pos', creating it on first sight */
+void ra_touch(var_t *var, int pos, int weight)
 {
-    /* Spill all locals on pointer writes (conservative aliasing handling) */
-    if (insn && insn->opcode == OP_write) {
-        for (int i = 0; i < REG_CNT; i++) {
-            if (REGS[i].var && !REGS[i].var->is_global)
-                spill_var(bb, REGS[i].var, i);
+    if (!var || var->is_func)
+        return;
+
+    /* values in memory only need an interval to share their stack slots */
+    if (var->vreg_flags & VREG_MEMORY) {
+        if (var->is_global || var->address_taken)
+            return;
+        if (var->first_use < 0) {
+            var->first_use = pos;
+            MEM_VARS[mem_cnt++] = var;
         }
+        if (pos > var->last_use)
+            var->last_use = pos;
+        if (var->use_count < (1 << 20))
+            var->use_count += weight;
         return;
     }
 
-    /* Standard spilling for non-pointer operations */
-    for (int i = 0; i < REG_CNT; i++) {
-        if (!REGS[i].var)
-            continue;
-        if (check_live_out(bb, REGS[i].var)) {
-            spill_var(bb, REGS[i].var, i);
-            continue;
+    /* constants without definition are materialized at each use */
+    if (!(var->vreg_flags & VREG_DEFINED) && var->is_const) {
+        var->vreg_flags |= VREG_MEMORY | VREG_REMAT;
+        return;
+    }
+
+    if (var->vreg_id < 0) {
+        var->vreg_id = vreg_cnt;
+        VREGS[vreg_cnt++] = var;
+        var->first_use = pos;
+        var->last_use = pos;
+    }
+
+    var = VREGS[var->vreg_id];
+    if (pos > var->last_use)
+        var->last_use = pos;
+    if (var->use_count < (1 << 20))
+        var->use_count += weight;
+}
+
+void ra_touch_list(var_list_t *list, int pos, int weight)
+{
+    for (int i = 0; i < list->size; i++)
+        ra_touch(list->elements[i], pos, weight);
+}
+
+/* Whether the copy 'rd = rs1' can share one interval for both values */
+bool ra_can_coalesce(insn_t *insn)
+{
+    var_t *rd = insn->rd, *rs1 = insn->rs1;
+    int mask = VREG_MEMORY | VREG_MULTI_DEF;
+
+    if (rd->consumed == -1 || rd->vreg_id >= 0 || rs1->vreg_id < 0)
+        return false;
+    if ((rd->vreg_flags & mask) || (rs1->vreg_flags & mask))
+        return false;
+    if (rd->is_const || rs1->is_const || rs1->is_func)
+        return false;
+
+    rs1 = vreg_rep(rs1);
+    return !(rs1->vreg_flags & mask);
+}
+
+/* Number the instructions and build the live intervals. Uses of an
+ * instruction are at its position, definitions one past it, so an operand
+ * dying at an instruction can share the register with its result.
+ */
+void ra_build_intervals(func_t *func)
+{
+    insn_t *args[MAX_PARAMS];
+    int argc = 0, pos = 2, run_start = 0, run_end = 0;
+
+    /* parameters arrive in the argument registers */
+    for (int i = 0; i < func->num_params && i < MAX_ARGS_IN_REG; i++) {
+        var_t *param = func->param_defs[i].subscripts[0];
+        ra_touch(param, 0, 1);
+        param->reg_hint = i;
+    }
+
+    for (basic_block_t *bb = func->bbs; bb; bb = bb->rpo_next) {
+        int weight = 1;
+        for (int i = 0; i < bb->loop_depth && i < 4; i++)
+            weight *= 8;
+
+        ra_touch_list(&bb->live_in, pos, weight);
+        pos += 2;
+
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
+            insn->idx = pos;
+
+            switch (insn->opcode) {
+            case OP_address_of:
+            case OP_global_address_of:
+                break;
+            case OP_push:
+                args[argc++] = insn;
+                break;
+            case OP_call:
+            case OP_indirect:
+                /* arguments are consumed by the call itself */
+                for (int i = 0; i < argc; i++)
+                    ra_touch(args[i]->rs1, pos, weight);
+                argc = 0;
+                ra_touch(insn->rs1, pos, weight);
+                CALL_POS[call_cnt] = pos;
+                CALL_COST[call_cnt + 1] = CALL_COST[call_cnt] + weight;
+                call_cnt++;
+                break;
+            case OP_unwound_phi:
+                /* The copies of a run are parallel, and their results may be
+                 * written before all sources are read. The sources live
+                 * until the last copy, the results from the first one on.
+                 */
+                if (pos > run_end) {
+                    run_start = pos;
+                    run_end = pos;
+                    for (insn_t *p = insn->next;
+                         p && p->opcode == OP_unwound_phi; p = p->next)
+                        run_end += 2;
+                }
+                ra_touch(insn->rs1, run_end, weight);
+                break;
+            default:
+                ra_touch(insn->rs1, pos, weight);
+                if (!(insn->opcode == OP_write && insn->rs2->is_func))
+                    ra_touch(insn->rs2, pos, weight);
+                break;
+            }
+
+            if (ra_is_def(insn)) {
+                if (insn->opcode == OP_assign && ra_can_coalesce(insn)) {
+                    var_t *rep = vreg_rep(insn->rs1);
+                    insn->rd->vreg_id = insn->rs1->vreg_id;
+                    insn->rd->vreg_flags |= VREG_SHARED;
+                    rep->vreg_flags |= VREG_SHARED;
+                }
+                if (insn->opcode == OP_unwound_phi)
+                    ra_touch(insn->rd, run_start + 1, weight);
+                else
+                    ra_touch(insn->rd, pos + 1, weight);
+                if (insn->opcode == OP_func_ret)
+                    insn->rd->reg_hint = 0;
+            }
+            pos += 2;
         }
-        if (REGS[i].var->consumed > insn->idx) {
-            spill_var(bb, REGS[i].var, i);
-            continue;
+
+        ra_touch_list(&bb->live_out, pos, weight);
+        pos += 2;
+    }
+}
+
+/* Whether the value of 'var' after 'insn' is read later. A run of phi copies
+ * reads all its sources before writing any result.
+ */
+bool ra_live_after(insn_t *insn, var_t *var)
+{
+    bool killed = false;
+
+    for (insn_t *p = insn->next; p; p = p->next) {
+        if (killed && p->opcode != OP_unwound_phi)
+            return false;
+        if (p->rs1 == var || p->rs2 == var)
+            return true;
+        if (p->rd == var && ra_is_def(p)) {
+            if (p->opcode != OP_unwound_phi)
+                return false;
+            killed = true;
         }
     }
+    return !killed && check_live_out(insn->belong_to, var);
 }
 
-void spill_live_out(basic_block_t *bb)
+/* Let the intervals 'a' and 'b' become one, owned by the earlier of them */
+void ra_merge_intervals(var_t *a, var_t *b)
 {
-    for (int i = 0; i < REG_CNT; i++) {
-        if (!REGS[i].var)
+    var_t *tmp;
+
+    if (a->vreg_id > b->vreg_id) {
+        tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    if (b->last_use > a->last_use)
+        a->last_use = b->last_use;
+    a->use_count += b->use_count;
+    if (a->use_count > (1 << 20))
+        a->use_count = 1 << 20;
+    if (a->reg_hint < 0)
+        a->reg_hint = b->reg_hint;
+    a->vreg_flags |= b->vreg_flags & VREG_MULTI_DEF;
+
+    for (int i = 0; i < vreg_cnt; i++) {
+        if (VREGS[i] == b)
+            VREGS[i] = a;
+    }
+}
+
+/* Coalesce the result of each phi with the operands of its copies, so the
+ * copies need no code. An operand joins when no value of the web is live at
+ * its definition and it is not live at the definitions of the web. The
+ * operands are plain SSA values, defined once by a regular instruction.
+ */
+void ra_coalesce_phis(func_t *func)
+{
+    insn_t **copies;
+    var_t **members;
+    int ncopies = 0, nmembers = 0;
+
+    for (basic_block_t *bb = func->bbs; bb; bb = bb->rpo_next) {
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
+            if (insn->opcode == OP_unwound_phi)
+                ncopies++;
+        }
+    }
+    if (!ncopies)
+        return;
+
+    copies = arena_alloc(GENERAL_ARENA, ncopies * sizeof(insn_t *));
+    members = arena_alloc(GENERAL_ARENA, ncopies * sizeof(var_t *));
+    ncopies = 0;
+    for (basic_block_t *bb = func->bbs; bb; bb = bb->rpo_next) {
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
+            if (insn->opcode == OP_unwound_phi)
+                copies[ncopies++] = insn;
+        }
+    }
+
+    for (int i = 0; i < ncopies; i++) {
+        var_t *x = copies[i]->rd, *y = copies[i]->rs1;
+        var_t *web = vreg_rep(x);
+        insn_t *def = y->last_assign;
+        int mask = VREG_MEMORY | VREG_MULTI_DEF | VREG_REMAT | VREG_SHARED;
+        bool interfere = false;
+
+        if (x->vreg_id < 0 || y->vreg_id < 0 || web == vreg_rep(y))
             continue;
-        if (!check_live_out(bb, REGS[i].var)) {
-            vreg_clear_phys(REGS[i].var);
-            REGS[i].var = NULL;
-            REGS[i].polluted = 0;
+        if ((x->vreg_flags & (VREG_MEMORY | VREG_SHARED)) ||
+            (web->vreg_flags & VREG_MEMORY) || (y->vreg_flags & mask) ||
+            vreg_rep(y) != y)
             continue;
+        if (!def || def->rd != y || def->opcode == OP_unwound_phi)
+            continue;
+
+        if (ra_live_after(def, x))
+            continue;
+        for (int j = 0; j < ncopies && !interfere; j++) {
+            if (vreg_rep(copies[j]->rd) == web)
+                interfere = ra_live_after(copies[j], y);
+        }
+        for (int j = 0; j < nmembers && !interfere; j++) {
+            var_t *m = members[j];
+            if (vreg_rep(m) == web)
+                interfere = ra_live_after(def, m) ||
+                            ra_live_after(m->last_assign, y);
         }
-        if (!var_check_killed(REGS[i].var, bb)) {
-            vreg_clear_phys(REGS[i].var);
-            REGS[i].var = NULL;
-            REGS[i].polluted = 0;
+        if (interfere)
+            continue;
+
+        ra_merge_intervals(web, y);
+        y->vreg_flags |= VREG_SHARED;
+        members[nmembers++] = y;
+    }
+}
+
+int ra_spill_weight(var_t *var)
+{
+    int weight =
+        var->use_count * 16 / ((var->last_use - var->first_use) / 8 + 1);
+
+    if (var->vreg_flags & VREG_REMAT)
+        weight >>= 2;
+    return weight;
+}
+
+/* Intervals are created at their first touch, which already orders them by
+ * their start points.
+ */
+bool ra_callee_saved(int reg)
+{
+    return (REG_CALLEE_SAVED >> reg) & 1;
+}
+
+/* Index of the first call at or after 'pos' */
+int ra_find_call(int pos)
+{
+    int lo = 0, hi = call_cnt;
+
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (CALL_POS[mid] < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Loop-weighted number of calls strictly inside the live interval of 'var',
+ * i.e. roughly how often a caller-saved home would have to be reloaded.
+ */
+int ra_call_cost(var_t *var)
+{
+    int lo = ra_find_call(var->first_use + 1);
+    int hi = ra_find_call(var->last_use);
+
+    if (lo >= hi)
+        return 0;
+    return CALL_COST[hi] - CALL_COST[lo];
+}
+
+void ra_scan(void)
+{
+    int saved_used = 0;
+
+    for (int i = 0; i < REG_CNT; i++)
+        REGS[i].var = NULL;
+
+    for (int i = 0; i < vreg_cnt; i++) {
+        var_t *cur = VREGS[i], *victim;
+        int reg = -1, min_weight, cost;
+        bool cross;
+
+        /* merged into an earlier interval */
+        if (cur->vreg_id != i)
             continue;
+
+        cost = ra_call_cost(cur);
+        cross = cost > 0;
+
+        for (int r = 0; r < REG_CNT; r++) {
+            if (REGS[r].var && REGS[r].var->last_use < cur->first_use)
+                REGS[r].var = NULL;
+        }
+
+        if (cur->reg_hint >= 0 && cur->reg_hint < REG_CNT &&
+            !REGS[cur->reg_hint].var &&
+            (cost <= 1 || ra_callee_saved(cur->reg_hint)))
+            reg = cur->reg_hint;
+
+        /* Keep callee-saved registers for values living across calls. The
+         * first use of one costs a save and a restore per invocation, which
+         * only pays off against more than a single reload.
+         */
+        for (int r = 0; r < REG_CNT && reg < 0 && cross; r++) {
+            if (!REGS[r].var && ((saved_used >> r) & 1))
+                reg = r;
+        }
+        for (int r = 0; r < REG_CNT && reg < 0 && cost > 1; r++) {
+            if (!REGS[r].var && ra_callee_saved(r))
+                reg = r;
+        }
+        for (int r = 0; r < REG_CNT && reg < 0; r++) {
+            if (!REGS[r].var && !ra_callee_saved(r))
+                reg = r;
+        }
+        for (int r = 0; r < REG_CNT && reg < 0; r++) {
+            if (!REGS[r].var)
+                reg = r;
+        }
+
+        if (reg < 0) {
+            victim = cur;
+            min_weight = ra_spill_weight(cur);
+            for (int r = 0; r < REG_CNT; r++) {
+                int weight = ra_spill_weight(REGS[r].var);
+                if (weight < min_weight) {
+                    min_weight = weight;
+                    victim = REGS[r].var;
+                    reg = r;
+                }
+            }
+
+            victim->vreg_flags |= VREG_MEMORY;
+            victim->phys_reg = -1;
+            if (victim == cur)
+                continue;
+        }
+
+        cur->phys_reg = reg;
+        REGS[reg].var = cur;
+        if (ra_callee_saved(reg))
+            saved_used |= 1 << reg;
+        else if (cross) {
+            /* written back at definition, as the calls clobber the register */
+            cur->vreg_flags |= VREG_CROSS_CALL;
         }
-        spill_var(bb, REGS[i].var, i);
     }
+
+    for (int i = 0; i < REG_CNT; i++)
+        REGS[i].var = NULL;
 }
 
-/* The operand of 'OP_push' should not been killed until function called. */
-void extend_liveness(basic_block_t *bb, insn_t *insn, var_t *var, int offset)
+bool ra_needs_slot(var_t *var)
 {
-    if (check_live_out(bb, var))
+    if (var->space_is_allocated || var->is_global || var->address_taken)
+        return false;
+    if (var->vreg_flags & VREG_REMAT)
+        return false;
+    return var->phys_reg < 0 ||
+           (var->vreg_flags & (VREG_MEMORY | VREG_CROSS_CALL));
+}
+
+/* Give the values stored to the stack their slots up front. Values whose
+ * intervals do not overlap share a slot, and the most used slots come first,
+ * nearest to sp, where the short load and store forms reach them.
+ */
+void ra_assign_slots(func_t *func)
+{
+    var_t **vars;
+    int *slot_end, *slot_use, *rank;
+    int n = 0, nslots = 0, i = 0, j = 0;
+
+    vars = arena_alloc(GENERAL_ARENA, (vreg_cnt + mem_cnt + 1) *
+                                          sizeof(var_t *));
+
+    /* both lists are ordered by the start of the intervals */
+    while (i < vreg_cnt || j < mem_cnt) {
+        var_t *var;
+
+        if (j >= mem_cnt ||
+            (i < vreg_cnt && VREGS[i]->first_use <= MEM_VARS[j]->first_use)) {
+            var = VREGS[i++];
+            if (var->vreg_id != i - 1)
+                continue;
+        } else
+            var = MEM_VARS[j++];
+        if (ra_needs_slot(var))
+            vars[n++] = var;
+    }
+    if (!n)
+        return;
+
+    slot_end = arena_alloc(GENERAL_ARENA, n * sizeof(int));
+    slot_use = arena_alloc(GENERAL_ARENA, n * sizeof(int));
+    rank = arena_alloc(GENERAL_ARENA, n * sizeof(int));
+
+    for (i = 0; i < n; i++) {
+        var_t *var = vars[i];
+        int slot = 0;
+
+        while (slot < nslots && slot_end[slot] >= var->first_use)
+            slot++;
+        if (slot == nslots)
+            slot_use[nslots++] = 0;
+
+        slot_end[slot] = var->last_use;
+        if (slot_use[slot] < (1 << 28))
+            slot_use[slot] += var->use_count;
+        var->offset = slot;
+    }
+
+    /* rank the slots by use, hottest first */
+    for (i = 0; i < nslots; i++) {
+        rank[i] = 0;
+        for (j = 0; j < nslots; j++) {
+            if (slot_use[j] > slot_use[i] ||
+                (slot_use[j] == slot_use[i] && j < i))
+                rank[i]++;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        var_t *var = vars[i];
+        var->offset = func->stack_size + rank[var->offset] * 4;
+        var->space_is_allocated = true;
+    }
+    /* keep the locals allocated after the slots 8-byte aligned */
+    func->stack_size += ALIGN_UP(nslots * 4, MIN_ALIGNMENT);
+}
+
+void ra_alloc_slot(func_t *func, var_t *var)
+{
+    if (var->space_is_allocated)
+        return;
+
+    var->offset = func->stack_size;
+    var->space_is_allocated = true;
+    func->stack_size += 4;
+}
+
+/* Emit the constant or address defined by 'def' into 'reg' */
+void ra_emit_value(basic_block_t *bb, insn_t *def, int reg)
+{
+    var_t *target = def->rs1;
+    ph2_ir_t *ir;
+
+    switch (def->opcode) {
+    case OP_address_of:
+    case OP_global_address_of:
+        /* make sure variable is on stack */
+        ra_alloc_slot(bb->belong_to, target);
+
+        if (target->is_global || def->opcode == OP_global_address_of)
+            ir = bb_add_ph2_ir(bb, OP_global_address_of);
+        else
+            ir = bb_add_ph2_ir(bb, OP_address_of);
+        ir->src0 = target->offset;
+        ir->ofs_based_on_stack_top = target->ofs_based_on_stack_top;
+        break;
+    default:
+        ir = bb_add_ph2_ir(bb, def->opcode);
+        ir->src0 = def->rd->init_val;
+        break;
+    }
+    ir->dest = reg;
+}
+
+/* Load the value of 'var' from its home in memory */
+void ra_load_var(basic_block_t *bb, var_t *var, int reg)
+{
+    ph2_ir_t *ir;
+
+    if (var->vreg_flags & VREG_REMAT) {
+        /* constants without definition carry their value themselves */
+        if (var->vreg_flags & VREG_DEFINED) {
+            ra_emit_value(bb, var->last_assign, reg);
+            return;
+        }
+        ir = bb_add_ph2_ir(bb, OP_load_constant);
+        ir->src0 = var->init_val;
+    } else {
+        ra_alloc_slot(bb->belong_to, var);
+        ir = var->is_global ? bb_add_ph2_ir(bb, OP_global_load)
+                            : bb_add_ph2_ir(bb, OP_load);
+        ir->src0 = var->offset;
+        ir->ofs_based_on_stack_top = var->ofs_based_on_stack_top;
+    }
+    ir->dest = reg;
+}
+
+void ra_store_var(basic_block_t *bb, var_t *var, int reg)
+{
+    ra_alloc_slot(bb->belong_to, var);
+
+    ph2_ir_t *ir = var->is_global ? bb_add_ph2_ir(bb, OP_global_store)
+                                  : bb_add_ph2_ir(bb, OP_store);
+    ir->src0 = reg;
+    ir->src1 = var->offset;
+    ir->ofs_based_on_stack_top = var->ofs_based_on_stack_top;
+}
+
+/* Return the register holding the current value of 'var', or -1 */
+int ra_valid_reg(var_t *var)
+{
+    var_t *rep = vreg_rep(var);
+
+    if (rep->phys_reg < 0 || (rep->vreg_flags & (VREG_MEMORY | VREG_STALE)))
+        return -1;
+    return rep->phys_reg;
+}
+
+/* Prepare 'var' for reading; spilled values are loaded into 'scratch' */
+int ra_use(basic_block_t *bb, var_t *var, int scratch)
+{
+    var_t *rep = vreg_rep(var);
+
+    if (rep->phys_reg < 0 || (rep->vreg_flags & VREG_MEMORY)) {
+        ra_load_var(bb, rep, scratch);
+        return scratch;
+    }
+
+    if (rep->vreg_flags & VREG_STALE) {
+        ra_load_var(bb, rep, rep->phys_reg);
+        rep->vreg_flags = rep->vreg_flags & ~VREG_STALE;
+    }
+    return rep->phys_reg;
+}
+
+int ra_def_reg(var_t *var)
+{
+    var_t *rep = vreg_rep(var);
+
+    if (rep->phys_reg < 0 || (rep->vreg_flags & VREG_MEMORY))
+        return REG_SCRATCH0;
+    return rep->phys_reg;
+}
+
+/* Write back a new value of 'var' held in 'reg' where needed */
+void ra_def_done(basic_block_t *bb, var_t *var, int reg)
+{
+    var_t *rep = vreg_rep(var);
+
+    if (!(rep->vreg_flags & VREG_REMAT) &&
+        (rep->phys_reg < 0 ||
+         (rep->vreg_flags & (VREG_MEMORY | VREG_CROSS_CALL))))
+        ra_store_var(bb, rep, reg);
+    rep->vreg_flags = rep->vreg_flags & ~VREG_STALE;
+}
+
+/* Copy 'src' to 'dst'. The peephole optimizer folds a move into the
+ * instruction producing its source, so a source still needed afterwards is
+ * copied with OP_cast, which it leaves alone.
+ */
+void ra_move(basic_block_t *bb, int dst, int src, bool keep_src)
+{
+    ph2_ir_t *tail = bb->ph2_ir_list.tail, *ir;
+
+    if (dst == src)
         return;
-    if (insn->idx + offset > var->consumed)
-        var->consumed = insn->idx + offset;
+
+    if (keep_src && tail && tail->dest == src && is_fusible_insn(tail))
+        ir = bb_add_ph2_ir(bb, OP_cast);
+    else
+        ir = bb_add_ph2_ir(bb, OP_assign);
+    ir->src0 = src;
+    ir->dest = dst;
+}
+
+/* Perform the moves 'dst[i] = src[i]' as if all at once. Destinations are
+ * distinct; a cycle is broken through REG_SCRATCH1.
+ */
+void ra_parallel_move(basic_block_t *bb, int *dst, int *src, int n)
+{
+    while (n > 0) {
+        int k = -1;
+        bool keep = false;
+
+        for (int i = 0; i < n && k < 0; i++) {
+            bool blocked = false;
+            for (int j = 0; j < n; j++) {
+                if (j != i && src[j] == dst[i])
+                    blocked = true;
+            }
+            if (!blocked)
+                k = i;
+        }
+
+        if (k < 0) {
+            int from = dst[0];
+            ra_move(bb, REG_SCRATCH1, from, false);
+            for (int i = 0; i < n; i++) {
+                if (src[i] == from)
+                    src[i] = REG_SCRATCH1;
+            }
+            continue;
+        }
+
+        /* a source in a callee-saved register may stay live past a call */
+        if (ra_callee_saved(src[k]))
+            keep = true;
+        for (int j = 0; j < n; j++) {
+            if (j != k && src[j] == src[k])
+                keep = true;
+        }
+        ra_move(bb, dst[k], src[k], keep);
+
+        n--;
+        dst[k] = dst[n];
+        src[k] = src[n];
+    }
 }
 
-/* Return whether extra arguments are pushed onto stack. */
-bool abi_lower_call_args(basic_block_t *bb, insn_t *insn)
+/* A call at 'pos' clobbers every register; values living on past it become
+ * stale until reloaded from their slots.
+ */
+void ra_clobber(int pos)
 {
-    int num_of_args = 0;
-    int stack_args = 0;
-    while (insn && insn->opcode == OP_push) {
-        num_of_args += 1;
-        insn = insn->next;
+    int n = 0;
+
+    for (int i = 0; i < stale_cnt; i++) {
+        if (STALE_VARS[i]->vreg_flags & VREG_STALE)
+            STALE_VARS[n++] = STALE_VARS[i];
     }
+    stale_cnt = n;
+
+    while (vreg_next < vreg_cnt && VREGS[vreg_next]->first_use < pos) {
+        var_t *var = VREGS[vreg_next++];
+        if (var->phys_reg >= 0 && !(var->vreg_flags & VREG_MEMORY))
+            REGS[var->phys_reg].var = var;
+    }
+
+    for (int i = 0; i < REG_CNT; i++) {
+        var_t *var = REGS[i].var;
+        if (!var || var->last_use <= pos || (var->vreg_flags & VREG_STALE) ||
+            ra_callee_saved(i))
+            continue;
+        var->vreg_flags |= VREG_STALE;
+        STALE_VARS[stale_cnt++] = var;
+    }
+}
+
+/* Successors expect live-out values in their registers */
+void ra_block_end(basic_block_t *bb)
+{
+    if (!stale_cnt)
+        return;
+
+    for (int i = 0; i < bb->live_out.size; i++) {
+        var_t *var = bb->live_out.elements[i];
+        if (var->vreg_flags & VREG_MEMORY)
+            continue;
+
+        var = vreg_rep(var);
+        if (var->phys_reg >= 0 && (var->vreg_flags & VREG_STALE))
+            ra_load_var(bb, var, var->phys_reg);
+    }
+
+    for (int i = 0; i < stale_cnt; i++)
+        STALE_VARS[i]->vreg_flags = STALE_VARS[i]->vreg_flags & ~VREG_STALE;
+    stale_cnt = 0;
+}
+
+/* Whether the comparison ending the ph2 IR of 'bb' computes the condition of
+ * the branch 'insn' in register 'reg' and nothing else reads it. The branch
+ * then compares the operands itself and the 0/1 value is never built.
+ */
+bool ra_fusible_branch(basic_block_t *bb, insn_t *insn, int reg)
+{
+    ph2_ir_t *tail = bb->ph2_ir_list.tail;
+    var_t *cond = vreg_rep(insn->rs1);
+
+    if (!tail || tail->dest != reg)
+        return false;
 
-    if (num_of_args <= MAX_ARGS_IN_REG)
+    switch (tail->op) {
+    case OP_eq:
+    case OP_neq:
+    case OP_gt:
+    case OP_geq:
+    case OP_lt:
+    case OP_leq:
+        return cond->last_use <= insn->idx;
+    default:
         return false;
+    }
+}
+
+/* The peephole optimizer folds a constant into the instruction that follows
+ * its load and drops the load. Feed a constant used again later from a fresh
+ * copy instead.
+ */
+int ra_fresh_const(basic_block_t *bb,
+                   insn_t *insn,
+                   var_t *var,
+                   int reg,
+                   int scratch)
+{
+    ph2_ir_t *tail = bb->ph2_ir_list.tail;
+
+    if (!tail || tail->op != OP_load_constant || tail->dest != reg)
+        return reg;
+
+    var = vreg_rep(var);
+    if (reg == scratch || var->last_use <= insn->idx)
+        return reg;
+
+    ph2_ir_t *ir = bb_add_ph2_ir(bb, OP_load_constant);
+    ir->src0 = tail->src0;
+    ir->dest = scratch;
+    return scratch;
+}
+
+/* Whether the copy 'insn' of a phi run has any effect */
+bool ra_phi_copy_needed(basic_block_t *bb, insn_t *insn)
+{
+    return vreg_rep(insn->rd) != vreg_rep(insn->rs1) &&
+           check_live_out(bb, insn->rd);
+}
+
+bool ra_in_memory(var_t *var)
+{
+    var = vreg_rep(var);
+    return var->phys_reg < 0 || (var->vreg_flags & VREG_MEMORY);
+}
+
+/* Emit a run of unwound phi copies. They are parallel: every source is read
+ * before any result is written. Results kept in memory are stored first,
+ * after saving the sources they overwrite in temporary slots, and results in
+ * registers are written last as one parallel move.
+ */
+insn_t *ra_unwound_phis(basic_block_t *bb, insn_t *insn)
+{
+    func_t *func = bb->belong_to;
+    insn_t *last = insn, *p;
+    int dst[REG_CNT], src[REG_CNT];
+    int *saved = NULL;
+    int n = 1, i = 0, moves = 0;
+
+    while (last->next && last->next->opcode == OP_unwound_phi) {
+        last = last->next;
+        n++;
+    }
+
+    for (p = insn; p != last->next; p = p->next) {
+        var_t *src_var = vreg_rep(p->rs1);
+        bool clobbered = false;
+
+        for (insn_t *q = insn; q != last->next; q = q->next) {
+            if (q != p && vreg_rep(q->rd) == src_var && ra_in_memory(q->rd) &&
+                ra_phi_copy_needed(bb, q))
+                clobbered = true;
+        }
+
+        if (clobbered && ra_phi_copy_needed(bb, p)) {
+            int reg;
+
+            if (!saved) {
+                saved = arena_alloc(GENERAL_ARENA, n * sizeof(int));
+                for (int j = 0; j < n; j++)
+                    saved[j] = -1;
+            }
+            /* the temporaries are dead after the run, so all runs of the
+             * function share them
+             */
+            reg = ra_use(bb, p->rs1, REG_SCRATCH0);
+            while (phi_tmp_cnt <= i) {
+                PHI_TMP_SLOTS[phi_tmp_cnt++] = func->stack_size;
+                func->stack_size += 4;
+            }
+            saved[i] = PHI_TMP_SLOTS[i];
 
-    insn = insn->prev;
-    stack_args = num_of_args - MAX_ARGS_IN_REG;
-    while (stack_args) {
-        load_var(bb, insn->rs1, MAX_ARGS_IN_REG - 1);
-        ph2_ir_t *ir = bb_add_ph2_ir(bb, OP_store);
-        ir->src0 = MAX_ARGS_IN_REG - 1;
-        ir->src1 = (stack_args - 1) * 4;
-        stack_args -= 1;
-        insn = insn->prev;
-    }
-    REGS[MAX_ARGS_IN_REG - 1].var = NULL;
-    return true;
+            ph2_ir_t *ir = bb_add_ph2_ir(bb, OP_store);
+            ir->src0 = reg;
+            ir->src1 = saved[i];
+        }
+        i++;
+    }
+
+    i = 0;
+    for (p = insn; p != last->next; p = p->next) {
+        int reg;
+
+        if (ra_phi_copy_needed(bb, p) && ra_in_memory(p->rd)) {
+            if (saved && saved[i] >= 0) {
+                ph2_ir_t *ir = bb_add_ph2_ir(bb, OP_load);
+                ir->src0 = saved[i];
+                ir->dest = REG_SCRATCH0;
+                reg = REG_SCRATCH0;
+            } else
+                reg = ra_use(bb, p->rs1, REG_SCRATCH0);
+            ra_def_done(bb, p->rd, reg);
+        }
+        i++;
+    }
+
+    i = 0;
+    for (p = insn; p != last->next; p = p->next) {
+        int reg = ra_valid_reg(p->rs1);
+
+        if (ra_phi_copy_needed(bb, p) && !ra_in_memory(p->rd) &&
+            (!saved || saved[i] < 0) && reg >= 0) {
+            dst[moves] = ra_def_reg(p->rd);
+            src[moves] = reg;
+            moves++;
+        }
+        i++;
+    }
+    ra_parallel_move(bb, dst, src, moves);
+
+    /* sources in memory go straight into their results */
+    i = 0;
+    for (p = insn; p != last->next; p = p->next) {
+        int reg = ra_def_reg(p->rd);
+
+        if (ra_phi_copy_needed(bb, p) && !ra_in_memory(p->rd)) {
+            if (saved && saved[i] >= 0) {
+                ph2_ir_t *ir = bb_add_ph2_ir(bb, OP_load);
+                ir->src0 = saved[i];
+                ir->dest = reg;
+            } else if (ra_valid_reg(p->rs1) < 0)
+                ra_load_var(bb, vreg_rep(p->rs1), reg);
+        }
+        i++;
+    }
+
+    for (p = insn; p != last->next; p = p->next) {
+        if (ra_phi_copy_needed(bb, p) && !ra_in_memory(p->rd))
+            ra_def_done(bb, p->rd, ra_def_reg(p->rd));
+    }
+
+    return last;
+}
+
+/* Move the arguments into place and call. The target of an indirect call is
+ * kept in REG_SCRATCH0 if the argument registers would overwrite it, stack
+ * arguments go through REG_SCRATCH1.
+ */
+void ra_emit_call(basic_block_t *bb, insn_t *insn, insn_t **args, int argc)
+{
+    int dst[MAX_PARAMS], src[MAX_PARAMS];
+    int n = 0, target = -1;
+    int nreg = argc < MAX_ARGS_IN_REG ? argc : MAX_ARGS_IN_REG;
+    ph2_ir_t *ir;
+
+    if (insn->opcode == OP_indirect) {
+        target = ra_use(bb, insn->rs1, REG_SCRATCH0);
+        if (target < nreg) {
+            ra_move(bb, REG_SCRATCH0, target, true);
+            target = REG_SCRATCH0;
+        }
+    }
+
+    for (int i = MAX_ARGS_IN_REG; i < argc; i++) {
+        int reg = ra_valid_reg(args[i]->rs1);
+        if (reg < 0) {
+            ra_load_var(bb, vreg_rep(args[i]->rs1), REG_SCRATCH1);
+            reg = REG_SCRATCH1;
+        }
+        ir = bb_add_ph2_ir(bb, OP_store);
+        ir->src0 = reg;
+        ir->src1 = (i - MAX_ARGS_IN_REG) * 4;
+    }
+
+    for (int i = 0; i < nreg; i++) {
+        int reg = ra_valid_reg(args[i]->rs1);
+        if (reg >= 0) {
+            dst[n] = i;
+            src[n] = reg;
+            n++;
+        }
+    }
+    ra_parallel_move(bb, dst, src, n);
+
+    for (int i = 0; i < nreg; i++) {
+        if (ra_valid_reg(args[i]->rs1) < 0)
+            ra_load_var(bb, vreg_rep(args[i]->rs1), i);
+    }
+
+    if (insn->opcode == OP_indirect) {
+        ir = bb_add_ph2_ir(bb, OP_load_func);
+        ir->src0 = target;
+        bb_add_ph2_ir(bb, OP_indirect);
+    } else {
+        func_t *callee_func = find_func(insn->str);
+        if (dynlink)
+            callee_func->is_used = true;
+
+        ir = bb_add_ph2_ir(bb, OP_call);
+        strcpy(ir->func_name, insn->str);
+    }
+
+    ra_clobber(insn->idx);
+}
+
+/* Spill parameters living in memory or across calls and move the others from
+ * the argument registers to their own.
+ */
+void ra_enter_func(func_t *func)
+{
+    basic_block_t *bb = func->bbs;
+    int dst[MAX_PARAMS], src[MAX_PARAMS];
+    int n = 0;
+    int args_in_reg = func->num_params < MAX_ARGS_IN_REG ? func->num_params
+                                                         : MAX_ARGS_IN_REG;
+
+    for (int i = 0; i < args_in_reg; i++) {
+        var_t *param = func->param_defs[i].subscripts[0];
+
+        if (func->va_args)
+            continue;
+        if (param->vreg_flags & (VREG_MEMORY | VREG_CROSS_CALL))
+            ra_store_var(bb, param, i);
+        if (param->phys_reg >= 0 && !(param->vreg_flags & VREG_MEMORY)) {
+            dst[n] = param->phys_reg;
+            src[n] = i;
+            n++;
+        }
+    }
+    ra_parallel_move(bb, dst, src, n);
 }
 
 void reg_alloc(void)
@@ -564,16 +1615,11 @@ void reg_alloc(void)
         if (!strcmp(func->return_def.var_name, "main"))
             MAIN_BB = func->bbs;
 
-        for (int i = 0; i < REG_CNT; i++)
-            REGS[i].var = NULL;
-
-        /* set arguments available */
-        int args_in_reg = func->num_params < MAX_ARGS_IN_REG ? func->num_params
-                                                             : MAX_ARGS_IN_REG;
-        for (int i = 0; i < args_in_reg; i++) {
-            REGS[i].var = func->param_defs[i].subscripts[0];
-            REGS[i].polluted = 1;
-        }
+        ra_prepare(func);
+        ra_compute_loop_depth(func);
+        ra_build_intervals(func);
+        ra_coalesce_phis(func);
+        ra_scan();
 
         /* variadic function implementation */
         if (func->va_args) {
@@ -596,7 +1642,7 @@ void reg_alloc(void)
                     src0 = MAX_ARGS_IN_REG;
                 }
 
-                if (i < args_in_reg) {
+                if (i < func->num_params) {
                     func->param_defs[i].subscripts[0]->offset =
                         func->stack_size;
                     func->param_defs[i].subscripts[0]->space_is_allocated =
@@ -651,45 +1697,27 @@ void reg_alloc(void)
             }
         }
 
+        ra_assign_slots(func);
+        ra_enter_func(func);
+
         for (basic_block_t *bb = func->bbs; bb; bb = bb->rpo_next) {
-            bool is_pushing_args = false, handle_abi = false,
-                 args_on_stack = false;
-            int args = 0;
+            insn_t *args[MAX_PARAMS];
+            int argc = 0;
 
             bb->visited++;
 
             for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
-                func_t *callee_func;
                 ph2_ir_t *ir;
+                var_t *rep;
                 int dest, src0, src1;
-                int sz, clear_reg;
-
-                refresh(bb, insn);
+                int sz;
 
                 switch (insn->opcode) {
                 case OP_unwound_phi:
-                    track_var_use(insn->rs1, insn->idx);
-                    src0 = prepare_operand(bb, insn->rs1, -1);
-
-                    if (!insn->rd->space_is_allocated) {
-                        insn->rd->offset = bb->belong_to->stack_size;
-                        insn->rd->space_is_allocated = true;
-                        bb->belong_to->stack_size += 4;
-                    }
-
-                    ir = bb_add_ph2_ir(bb, OP_store);
-                    ir->src0 = src0;
-                    ir->src1 = insn->rd->offset;
-                    ir->ofs_based_on_stack_top =
-                        insn->rd->ofs_based_on_stack_top;
+                    insn = ra_unwound_phis(bb, insn);
                     break;
                 case OP_allocat:
-                    if ((insn->rd->type == TY_void ||
-                         insn->rd->type == TY_int ||
-                         insn->rd->type == TY_short ||
-                         insn->rd->type == TY_char ||
-                         insn->rd->type == TY_bool) &&
-                        insn->rd->array_size == 0)
+                    if (ra_is_scalar_allocat(insn->rd))
                         break;
 
                     insn->rd->offset = func->stack_size;
@@ -709,7 +1737,7 @@ void reg_alloc(void)
                     else
                         func->stack_size += align_size(sz);
 
-                    dest = prepare_dest(bb, insn->rd, -1, -1);
+                    dest = ra_def_reg(insn->rd);
                     ir = bb_add_ph2_ir(bb, OP_address_of);
                     ir->src0 = src0;
                     ir->dest = dest;
@@ -719,109 +1747,61 @@ void reg_alloc(void)
                     /* For arrays, store the base address just like global
                      * arrays do
                      */
-                    if (insn->rd->array_size)
-                        spill_var(bb, insn->rd, dest);
+                    rep = vreg_rep(insn->rd);
+                    if (insn->rd->array_size && dest != REG_SCRATCH0 &&
+                        !(rep->vreg_flags & VREG_CROSS_CALL))
+                        ra_store_var(bb, insn->rd, dest);
+                    ra_def_done(bb, insn->rd, dest);
                     break;
                 case OP_load_constant:
                 case OP_load_data_address:
                 case OP_load_rodata_address:
-                    dest = prepare_dest(bb, insn->rd, -1, -1);
-                    ir = bb_add_ph2_ir(bb, insn->opcode);
-                    ir->src0 = insn->rd->init_val;
-                    ir->dest = dest;
-
-                    /* store global variable immediately after assignment */
-                    if (insn->rd->is_global) {
-                        ir = bb_add_ph2_ir(bb, OP_global_store);
-                        ir->src0 = dest;
-                        ir->src1 = insn->rd->offset;
-                        REGS[dest].polluted = 0;
-                    }
-
-                    break;
                 case OP_address_of:
                 case OP_global_address_of:
-                    /* Mark variable as address-taken, disable constant
-                     * optimization
-                     */
-                    insn->rs1->address_taken = true;
-                    insn->rs1->is_const = false;
-
                     /* make sure variable is on stack */
-                    if (!insn->rs1->space_is_allocated) {
-                        insn->rs1->offset = bb->belong_to->stack_size;
-                        insn->rs1->space_is_allocated = true;
-                        bb->belong_to->stack_size += 4;
-
-                        for (int i = 0; i < REG_CNT; i++)
-                            if (REGS[i].var == insn->rs1) {
-                                ir = bb_add_ph2_ir(bb, OP_store);
-                                ir->src0 = i;
-                                ir->src1 = insn->rs1->offset;
-                                ir->ofs_based_on_stack_top =
-                                    insn->rs1->ofs_based_on_stack_top;
-                                /* Clear stale register tracking */
-                                REGS[i].var = NULL;
-                            }
-                    }
-
-                    dest = prepare_dest(bb, insn->rd, -1, -1);
-                    if (insn->rs1->is_global ||
+                    if (insn->opcode == OP_address_of ||
                         insn->opcode == OP_global_address_of)
-                        ir = bb_add_ph2_ir(bb, OP_global_address_of);
-                    else
-                        ir = bb_add_ph2_ir(bb, OP_address_of);
-                    ir->src0 = insn->rs1->offset;
-                    ir->dest = dest;
-                    ir->ofs_based_on_stack_top =
-                        insn->rs1->ofs_based_on_stack_top;
+                        ra_alloc_slot(func, insn->rs1);
+
+                    /* rematerialized at each use instead */
+                    rep = vreg_rep(insn->rd);
+                    if ((rep->vreg_flags & VREG_MEMORY) &&
+                        (rep->vreg_flags & VREG_REMAT))
+                        break;
+
+                    dest = ra_def_reg(insn->rd);
+                    ra_emit_value(bb, insn, dest);
+                    ra_def_done(bb, insn->rd, dest);
                     break;
                 case OP_assign:
                     if (insn->rd->consumed == -1)
                         break;
 
-                    track_var_use(insn->rs1, insn->idx);
-                    src0 = find_in_regs(insn->rs1);
-
-                    /* If operand is loaded from stack, clear the original slot
-                     * after moving.
-                     */
-                    if (src0 > -1)
-                        clear_reg = 0;
-                    else {
-                        clear_reg = 1;
-                        src0 = prepare_operand(bb, insn->rs1, -1);
-                    }
-                    dest = prepare_dest(bb, insn->rd, src0, -1);
-                    ir = bb_add_ph2_ir(bb, OP_assign);
-                    ir->src0 = src0;
-                    ir->dest = dest;
-
-                    /* store global variable immediately after assignment */
-                    if (insn->rd->is_global) {
-                        ir = bb_add_ph2_ir(bb, OP_global_store);
-                        ir->src0 = dest;
-                        ir->src1 = insn->rd->offset;
-                        REGS[dest].polluted = 0;
-                    }
-
-                    if (clear_reg) {
-                        vreg_clear_phys(REGS[src0].var);
-                        REGS[src0].var = NULL;
-                    }
+                    /* coalesced copies need no code */
+                    if (vreg_rep(insn->rd) == vreg_rep(insn->rs1))
+                        break;
 
+                    rep = vreg_rep(insn->rs1);
+                    dest = ra_def_reg(insn->rd);
+                    src0 = ra_valid_reg(insn->rs1);
+                    if (src0 < 0)
+                        ra_load_var(bb, rep, dest);
+                    else
+                        ra_move(bb, dest, src0, rep->last_use > insn->idx);
+                    ra_def_done(bb, insn->rd, dest);
                     break;
                 case OP_read:
-                    src0 = prepare_operand(bb, insn->rs1, -1);
-                    dest = prepare_dest(bb, insn->rd, src0, -1);
+                    src0 = ra_use(bb, insn->rs1, REG_SCRATCH0);
+                    dest = ra_def_reg(insn->rd);
                     ir = bb_add_ph2_ir(bb, OP_read);
                     ir->src0 = src0;
                     ir->src1 = insn->sz;
                     ir->dest = dest;
+                    ra_def_done(bb, insn->rd, dest);
                     break;
                 case OP_write:
                     if (insn->rs2->is_func) {
-                        src0 = prepare_operand(bb, insn->rs1, -1);
+                        src0 = ra_use(bb, insn->rs1, REG_SCRATCH0);
                         ir = bb_add_ph2_ir(bb, OP_address_of_func);
                         ir->src0 = src0;
                         strcpy(ir->func_name, insn->rs2->var_name);
@@ -831,14 +1811,8 @@ void reg_alloc(void)
                                 target_fn->is_used = true;
                         }
                     } else {
-                        /* FIXME: Register content becomes stale after store
-                         * operation. Current workaround causes redundant
-                         * spilling - need better register invalidation
-                         * strategy.
-                         */
-                        spill_alive(bb, insn);
-                        src0 = prepare_operand(bb, insn->rs1, -1);
-                        src1 = prepare_operand(bb, insn->rs2, src0);
+                        src0 = ra_use(bb, insn->rs1, REG_SCRATCH0);
+                        src1 = ra_use(bb, insn->rs2, REG_SCRATCH1);
                         ir = bb_add_ph2_ir(bb, OP_write);
                         ir->src0 = src0;
                         ir->src1 = src1;
@@ -846,82 +1820,39 @@ void reg_alloc(void)
                     }
                     break;
                 case OP_branch:
-                    src0 = prepare_operand(bb, insn->rs1, -1);
+                    src0 = ra_use(bb, insn->rs1, REG_SCRATCH0);
+                    ra_block_end(bb);
 
-                    /* REGS[src0].var had been set to NULL, but the actual
-                     * content is still holded in the register.
-                     */
-                    spill_live_out(bb);
-
-                    ir = bb_add_ph2_ir(bb, OP_branch);
-                    ir->src0 = src0;
+                    if (ra_fusible_branch(bb, insn, src0)) {
+                        ir = bb->ph2_ir_list.tail;
+                        ir->branch_cmp = ir->op;
+                        ir->op = OP_branch;
+                    } else {
+                        ir = bb_add_ph2_ir(bb, OP_branch);
+                        ir->src0 = src0;
+                    }
                     ir->then_bb = bb->then_;
                     ir->else_bb = bb->else_;
                     break;
                 case OP_push:
-                    extend_liveness(bb, insn, insn->rs1, insn->sz);
-
-                    if (!is_pushing_args) {
-                        spill_alive(bb, insn);
-                        is_pushing_args = true;
-                    }
-                    if (!handle_abi) {
-                        args_on_stack = abi_lower_call_args(bb, insn);
-                        handle_abi = true;
-                    }
-
-                    if (args_on_stack && args >= MAX_ARGS_IN_REG)
-                        break;
-
-                    src0 = prepare_operand(bb, insn->rs1, -1);
-                    ir = bb_add_ph2_ir(bb, OP_assign);
-                    ir->src0 = src0;
-                    ir->dest = args++;
-                    REGS[ir->dest].var = insn->rs1;
-                    REGS[ir->dest].polluted = 0;
+                    /* moved into place by the call */
+                    args[argc++] = insn;
                     break;
                 case OP_call:
-                    callee_func = find_func(insn->str);
-                    if (!callee_func->num_params)
-                        spill_alive(bb, insn);
-
-                    if (dynlink)
-                        callee_func->is_used = true;
-
-                    ir = bb_add_ph2_ir(bb, OP_call);
-                    strcpy(ir->func_name, insn->str);
-
-                    is_pushing_args = false;
-                    args = 0;
-                    handle_abi = false;
-
-                    for (int i = 0; i < REG_CNT; i++)
-                        REGS[i].var = NULL;
-
-                    break;
                 case OP_indirect:
-                    if (!args)
-                        spill_alive(bb, insn);
-
-                    src0 = prepare_operand(bb, insn->rs1, -1);
-                    ir = bb_add_ph2_ir(bb, OP_load_func);
-                    ir->src0 = src0;
-
-                    bb_add_ph2_ir(bb, OP_indirect);
-
-                    is_pushing_args = false;
-                    args = 0;
-                    handle_abi = false;
+                    ra_emit_call(bb, insn, args, argc);
+                    argc = 0;
                     break;
                 case OP_func_ret:
-                    dest = prepare_dest(bb, insn->rd, -1, -1);
-                    ir = bb_add_ph2_ir(bb, OP_assign);
-                    ir->src0 = 0;
-                    ir->dest = dest;
+                    dest = ra_def_reg(insn->rd);
+                    if (dest == REG_SCRATCH0)
+                        dest = 0;
+                    ra_move(bb, dest, 0, false);
+                    ra_def_done(bb, insn->rd, dest);
                     break;
                 case OP_return:
                     if (insn->rs1)
-                        src0 = prepare_operand(bb, insn->rs1, -1);
+                        src0 = ra_use(bb, insn->rs1, REG_SCRATCH0);
                     else
                         src0 = -1;
 
@@ -944,34 +1875,39 @@ void reg_alloc(void)
                 case OP_bit_and:
                 case OP_bit_or:
                 case OP_bit_xor:
-                    track_var_use(insn->rs1, insn->idx);
-                    track_var_use(insn->rs2, insn->idx);
-                    src0 = prepare_operand(bb, insn->rs1, -1);
-                    src1 = prepare_operand(bb, insn->rs2, src0);
-                    dest = prepare_dest(bb, insn->rd, src0, src1);
+                    src0 = ra_use(bb, insn->rs1, REG_SCRATCH0);
+                    src0 = ra_fresh_const(bb, insn, insn->rs1, src0,
+                                          REG_SCRATCH0);
+                    src1 = ra_use(bb, insn->rs2, REG_SCRATCH1);
+                    src1 = ra_fresh_const(bb, insn, insn->rs2, src1,
+                                          REG_SCRATCH1);
+                    dest = ra_def_reg(insn->rd);
                     ir = bb_add_ph2_ir(bb, insn->opcode);
                     ir->src0 = src0;
                     ir->src1 = src1;
                     ir->dest = dest;
+                    ra_def_done(bb, insn->rd, dest);
                     break;
                 case OP_negate:
                 case OP_bit_not:
                 case OP_log_not:
-                    src0 = prepare_operand(bb, insn->rs1, -1);
-                    dest = prepare_dest(bb, insn->rd, src0, -1);
+                    src0 = ra_use(bb, insn->rs1, REG_SCRATCH0);
+                    dest = ra_def_reg(insn->rd);
                     ir = bb_add_ph2_ir(bb, insn->opcode);
                     ir->src0 = src0;
                     ir->dest = dest;
+                    ra_def_done(bb, insn->rd, dest);
                     break;
                 case OP_trunc:
                 case OP_sign_ext:
                 case OP_cast:
-                    src0 = prepare_operand(bb, insn->rs1, -1);
-                    dest = prepare_dest(bb, insn->rd, src0, -1);
+                    src0 = ra_use(bb, insn->rs1, REG_SCRATCH0);
+                    dest = ra_def_reg(insn->rd);
                     ir = bb_add_ph2_ir(bb, insn->opcode);
                     ir->src1 = insn->sz;
                     ir->src0 = src0;
                     ir->dest = dest;
+                    ra_def_done(bb, insn->rd, dest);
                     break;
                 default:
                     printf("Unknown opcode\n");
@@ -979,8 +1915,7 @@ void reg_alloc(void)
                 }
             }
 
-            if (bb->next)
-                spill_live_out(bb);
+            ra_block_end(bb);
 
             if (bb == func->exit)
                 continue;
@@ -1019,14 +1954,33 @@ void reg_alloc(void)
     }
 }
 
+/* Mnemonic of the comparison 'op' */
+char *cmp_name(opcode_t op)
+{
+    switch (op) {
+    case OP_eq:
+        return "eq";
+    case OP_neq:
+        return "neq";
+    case OP_gt:
+        return "gt";
+    case OP_geq:
+        return "geq";
+    case OP_lt:
+        return "lt";
+    default:
+        return "leq";
+    }
+}
+
 void dump_ph2_ir(void)
 {
     for (int i = 0; i < ph2_ir_idx; i++) {
         ph2_ir_t *ph2_ir = PH2_IR_FLATTEN[i];
 
-        const int rd = ph2_ir->dest + 48;
-        const int rs1 = ph2_ir->src0 + 48;
-        const int rs2 = ph2_ir->src1 + 48;
+        const int rd = ph2_ir->dest;
+        const int rs1 = ph2_ir->src0;
+        const int rs2 = ph2_ir->src1;
 
         switch (ph2_ir->op) {
         case OP_define:
@@ -1035,25 +1989,29 @@ void dump_ph2_ir(void)
         case OP_allocat:
             continue;
         case OP_assign:
-            printf("\t%%x%c = %%x%c", rd, rs1);
+            printf("\t%%x%d = %%x%d", rd, rs1);
             break;
         case OP_load_constant:
-            printf("\tli %%x%c, $%d", rd, ph2_ir->src0);
+            printf("\tli %%x%d, $%d", rd, ph2_ir->src0);
             break;
         case OP_load_data_address:
-            printf("\t%%x%c = .data(%d)", rd, ph2_ir->src0);
+            printf("\t%%x%d = .data(%d)", rd, ph2_ir->src0);
             break;
         case OP_load_rodata_address:
-            printf("\t%%x%c = .rodata(%d)", rd, ph2_ir->src0);
+            printf("\t%%x%d = .rodata(%d)", rd, ph2_ir->src0);
             break;
         case OP_address_of:
-            printf("\t%%x%c = %%sp + %d", rd, ph2_ir->src0);
+            printf("\t%%x%d = %%sp + %d", rd, ph2_ir->src0);
             break;
         case OP_global_address_of:
-            printf("\t%%x%c = %%gp + %d", rd, ph2_ir->src0);
+            printf("\t%%x%d = %%gp + %d", rd, ph2_ir->src0);
             break;
         case OP_branch:
-            printf("\tbr %%x%c", rs1);
+            if (ph2_ir->branch_cmp == OP_generic)
+                printf("\tbr %%x%d", rs1);
+            else
+                printf("\tbr %s %%x%d, %%x%d", cmp_name(ph2_ir->branch_cmp),
+                       rs1, rs2);
             break;
         case OP_jump:
             printf("\tj %s", ph2_ir->func_name);
@@ -1065,28 +2023,28 @@ void dump_ph2_ir(void)
             if (ph2_ir->src0 == -1)
                 printf("\tret");
             else
-                printf("\tret %%x%c", rs1);
+                printf("\tret %%x%d", rs1);
             break;
         case OP_load:
-            printf("\tload %%x%c, %d(sp)", rd, ph2_ir->src0);
+            printf("\tload %%x%d, %d(sp)", rd, ph2_ir->src0);
             break;
         case OP_store:
-            printf("\tstore %%x%c, %d(sp)", rs1, ph2_ir->src1);
+            printf("\tstore %%x%d, %d(sp)", rs1, ph2_ir->src1);
             break;
         case OP_global_load:
-            printf("\tload %%x%c, %d(gp)", rd, ph2_ir->src0);
+            printf("\tload %%x%d, %d(gp)", rd, ph2_ir->src0);
             break;
         case OP_global_store:
-            printf("\tstore %%x%c, %d(gp)", rs1, ph2_ir->src1);
+            printf("\tstore %%x%d, %d(gp)", rs1, ph2_ir->src1);
             break;
         case OP_read:
-            printf("\t%%x%c = (%%x%c)", rd, rs1);
+            printf("\t%%x%d = (%%x%d)", rd, rs1);
             break;
         case OP_write:
-            printf("\t(%%x%c) = %%x%c", rs1, rs2);
+            printf("\t(%%x%d) = %%x%d", rs1, rs2);
             break;
         case OP_address_of_func:
-            printf("\t(%%x%c) = @%s", rs1, ph2_ir->func_name);
+            printf("\t(%%x%d) = @%s", rs1, ph2_ir->func_name);
             break;
         case OP_load_func:
             printf("\tload %%t0, %d(sp)", ph2_ir->src0);
@@ -1098,70 +2056,79 @@ void dump_ph2_ir(void)
             printf("\tindirect call @(%%t0)");
             break;
         case OP_negate:
-            printf("\tneg %%x%c, %%x%c", rd, rs1);
+            printf("\tneg %%x%d, %%x%d", rd, rs1);
             break;
         case OP_add:
-            printf("\t%%x%c = add %%x%c, %%x%c", rd, rs1, rs2);
+            printf("\t%%x%d = add %%x%d, %%x%d", rd, rs1, rs2);
             break;
         case OP_sub:
-            printf("\t%%x%c = sub %%x%c, %%x%c", rd, rs1, rs2);
+            printf("\t%%x%d = sub %%x%d, %%x%d", rd, rs1, rs2);
             break;
         case OP_mul:
-            printf("\t%%x%c = mul %%x%c, %%x%c", rd, rs1, rs2);
+            printf("\t%%x%d = mul %%x%d, %%x%d", rd, rs1, rs2);
             break;
         case OP_div:
-            printf("\t%%x%c = div %%x%c, %%x%c", rd, rs1, rs2);
+            printf("\t%%x%d = div %%x%d, %%x%d", rd, rs1, rs2);
             break;
         case OP_mod:
-            printf("\t%%x%c = mod %%x%c, %%x%c", rd, rs1, rs2);
+            printf("\t%%x%d = mod %%x%d, %%x%d", rd, rs1, rs2);
+            break;
+        case OP_div_const:
+            printf("\t%%x%d = div %%x%d, $%d", rd, rs1, ph2_ir->src1);
+            break;
+        case OP_mod_const:
+            printf("\t%%x%d = mod %%x%d, $%d", rd, rs1, ph2_ir->src1);
+            break;
+        case OP_mul_const:
+            printf("\t%%x%d = mul %%x%d, $%d", rd, rs1, ph2_ir->src1);
             break;
         case OP_eq:
-            printf("\t%%x%c = eq %%x%c, %%x%c", rd, rs1, rs2);
+            printf("\t%%x%d = eq %%x%d, %%x%d", rd, rs1, rs2);
             break;
         case OP_neq:
-            printf("\t%%x%c = neq %%x%c, %%x%c", rd, rs1, rs2);
+            printf("\t%%x%d = neq %%x%d, %%x%d", rd, rs1, rs2);
             break;
         case OP_gt:
-            printf("\t%%x%c = gt %%x%c, %%x%c", rd, rs1, rs2);
+            printf("\t%%x%d = gt %%x%d, %%x%d", rd, rs1, rs2);
             break;
         case OP_lt:
-            printf("\t%%x%c = lt %%x%c, %%x%c", rd, rs1, rs2);
+            printf("\t%%x%d = lt %%x%d, %%x%d", rd, rs1, rs2);
             break;
         case OP_geq:
-            printf("\t%%x%c = geq %%x%c, %%x%c", rd, rs1, rs2);
+            printf("\t%%x%d = geq %%x%d, %%x%d", rd, rs1, rs2);
             break;
         case OP_leq:
-            printf("\t%%x%c = leq %%x%c, %%x%c", rd, rs1, rs2);
+            printf("\t%%x%d = leq %%x%d, %%x%d", rd, rs1, rs2);
             break;
         case OP_bit_and:
-            printf("\t%%x%c = and %%x%c, %%x%c", rd, rs1, rs2);
+            printf("\t%%x%d = and %%x%d, %%x%d", rd, rs1, rs2);
             break;
         case OP_bit_or:
-            printf("\t%%x%c = or %%x%c, %%x%c", rd, rs1, rs2);
+            printf("\t%%x%d = or %%x%d, %%x%d", rd, rs1, rs2);
             break;
         case OP_bit_not:
-            printf("\t%%x%c = not %%x%c", rd, rs1);
+            printf("\t%%x%d = not %%x%d", rd, rs1);
             break;
         case OP_bit_xor:
-            printf("\t%%x%c = xor %%x%c, %%x%c", rd, rs1, rs2);
+            printf("\t%%x%d = xor %%x%d, %%x%d", rd, rs1, rs2);
             break;
         case OP_log_not:
-            printf("\t%%x%c = not %%x%c", rd, rs1);
+            printf("\t%%x%d = not %%x%d", rd, rs1);
             break;
         case OP_rshift:
-            printf("\t%%x%c = rshift %%x%c, %%x%c", rd, rs1, rs2);
+            printf("\t%%x%d = rshift %%x%d, %%x%d", rd, rs1, rs2);
             break;
         case OP_lshift:
-            printf("\t%%x%c = lshift %%x%c, %%x%c", rd, rs1, rs2);
+            printf("\t%%x%d = lshift %%x%d, %%x%d", rd, rs1, rs2);
             break;
         case OP_trunc:
-            printf("\t%%x%c = trunc %%x%c, %d", rd, rs1, ph2_ir->src1);
+            printf("\t%%x%d = trunc %%x%d, %d", rd, rs1, ph2_ir->src1);
             break;
         case OP_sign_ext:
-            printf("\t%%x%c = sign_ext %%x%c, %d", rd, rs1, ph2_ir->src1);
+            printf("\t%%x%d = sign_ext %%x%d, %d", rd, rs1, ph2_ir->src1);
             break;
         case OP_cast:
-            printf("\t%%x%c = cast %%x%c", rd, rs1);
+            printf("\t%%x%d = cast %%x%d", rd, rs1);
             break;
         default:
             break;
@@ -10,8 +10,137 @@
 #include "globals.c"
 #include "riscv.c"
 
+/* Offsets of the runtime multiplication and division helpers, or -1 if
+ * nothing calls them
+ */
+int mul_helper_ofs = -1;
+int divmod_helper_ofs = -1;
+
+/* Map an allocator register index to the register it stands for: 0-7 are
+ * a0-a7, 8 is s1, 9-18 are s2-s11 and 19 is t6.
+ */
+int rv_reg_of(int reg)
+{
+    if (reg < 8)
+        return reg + __a0;
+    if (reg == 8)
+        return __s1;
+    if (reg < 19)
+        return reg - 9 + __s2;
+    return __t6;
+}
+
+/* Bytes taken by saving the registers in 'mask' */
+int saved_regs_size(int mask)
+{
+    int size = 0;
+
+    for (; mask; mask = mask >> 1)
+        size += (mask & 1) << 2;
+    return size;
+}
+
+/* Bytes taken by loading 'value' into a register */
+int rv_li_size(int value)
+{
+    if (value < -2048 || value > 2047)
+        return 8;
+    return 4;
+}
+
+/* Number of bits set in 'value' from bit 'lo' up */
+int rv_bits_set(int value, int lo)
+{
+    int count = 0;
+
+    for (int i = lo; i < 32; i++)
+        count += (value >> i) & 1;
+    return count;
+}
+
+/* Length of the period of the binary expansion of 1 / divisor, or 0 if it
+ * repeats only after more than 16 bits
+ */
+int rv_recip_period(int divisor)
+{
+    int rem = 1;
+
+    while (!(divisor & 1))
+        divisor >>= 1;
+    for (int period = 1; period <= 16; period++) {
+        rem = (rem << 1) % divisor;
+        if (rem == 1)
+            return period;
+    }
+    return 0;
+}
+
+/* Number of times rv_emit_div_const() doubles the reciprocal estimate */
+int rv_recip_steps(int period)
+{
+    int steps = 0;
+
+    if (!period)
+        return 0;
+    for (int step = period; step < 32; step += step)
+        steps++;
+    return steps;
+}
+
+/* Floor of log2 of the positive 'value' */
+int rv_log2(int value)
+{
+    int log = 0;
+
+    while (value > 1) {
+        value >>= 1;
+        log++;
+    }
+    return log;
+}
+
+/* Size of the code rv_emit_div_const() emits for 'ph2_ir' */
+int rv_div_const_size(ph2_ir_t *ph2_ir)
+{
+    int divisor = ph2_ir->src1, size;
+    int abs_divisor = divisor < 0 ? -divisor : divisor;
+    int magic, shift, period, rem;
+
+    if (pow2_shift(abs_divisor) > 0) {
+        if (ph2_ir->op == OP_mod_const)
+            return 24;
+        return divisor > 0 ? 16 : 20;
+    }
+
+    if (hard_mul_div) {
+        div_magic(abs_divisor, &magic, &shift);
+        size = rv_li_size(magic) + 8;
+        if (magic < 0)
+            size += 4;
+        if (shift > 0)
+            size += 4;
+        if (ph2_ir->op == OP_div_const)
+            return divisor < 0 ? size + 8 : size + 4;
+        return size + rv_li_size(abs_divisor) + 12;
+    }
+
+    shift = rv_log2(abs_divisor);
+    magic = div_reciprocal(abs_divisor, shift, &rem);
+    period = rv_recip_period(abs_divisor);
+    /* |x|, the estimate, its remainder and the correction loop */
+    size = 12 + rv_bits_set(magic, period ? 32 - period : 1) * 8 - 4;
+    size += rv_recip_steps(period) * 8 + 4;
+    size += rv_bits_set(abs_divisor, 0) * 8;
+    size += rv_li_size(abs_divisor) + 16;
+    if (ph2_ir->op == OP_div_const && divisor < 0)
+        size += 4;
+    return size + 8;
+}
+
 void update_elf_offset(ph2_ir_t *ph2_ir)
 {
+    int plan[MAX_MUL_STEPS];
+
     switch (ph2_ir->op) {
     case OP_load_constant:
         if (ph2_ir->src0 < -2048 || ph2_ir->src0 > 2047)
@@ -65,6 +194,8 @@ void update_elf_offset(ph2_ir_t *ph2_ir)
     case OP_mul:
         if (hard_mul_div)
             elf_offset += 4;
+        else if (ph2_ir->calls_runtime_helper)
+            elf_offset += 16;
         else
             elf_offset += 52;
         return;
@@ -72,9 +203,18 @@ void update_elf_offset(ph2_ir_t *ph2_ir)
     case OP_mod:
         if (hard_mul_div)
             elf_offset += 4;
+        else if (ph2_ir->calls_runtime_helper)
+            elf_offset += 16;
         else
             elf_offset += 108;
         return;
+    case OP_div_const:
+    case OP_mod_const:
+        elf_offset += rv_div_const_size(ph2_ir);
+        return;
+    case OP_mul_const:
+        elf_offset += mul_const_plan(ph2_ir->src1, plan) * 4;
+        return;
     case OP_load_data_address:
     case OP_load_rodata_address:
     case OP_neq:
@@ -91,7 +231,13 @@ void update_elf_offset(ph2_ir_t *ph2_ir)
         elf_offset += 20;
         return;
     case OP_return:
-        elf_offset += 24;
+        /* a frameless function only moves its result and returns */
+        if (ph2_ir->src1 < 0 && ph2_ir->src0 > 0)
+            elf_offset += 8;
+        else if (ph2_ir->src1 < 0)
+            elf_offset += 4;
+        else
+            elf_offset += 24 + saved_regs_size(ph2_ir->dest);
         return;
     case OP_trunc:
         if (ph2_ir->src1 == 2)
@@ -118,6 +264,7 @@ void update_elf_offset(ph2_ir_t *ph2_ir)
 
 void cfg_flatten(void)
 {
+    bool mul_used = false, divmod_used = false;
     func_t *func = find_func("__syscall");
     /* Prologue ~ 6 instructions (24 bytes). Place __syscall right after. */
     func->bbs->elf_offset = 24;
@@ -139,17 +286,19 @@ void cfg_flatten(void)
         if (!func->bbs)
             continue;
 
-        /* reserve stack */
+        /* reserve stack, a size of -1 marks a function without a frame */
+        int stack_size = func->frameless ? -1 : func->stack_size;
         ph2_ir_t *flatten_ir = add_ph2_ir(OP_define);
-        flatten_ir->src0 = func->stack_size;
+        flatten_ir->src0 = stack_size;
+        flatten_ir->src1 = func->saved_regs;
         strncpy(flatten_ir->func_name, func->return_def.var_name, MAX_VAR_LEN);
 
         for (basic_block_t *bb = func->bbs; bb; bb = bb->rpo_next) {
             bb->elf_offset = elf_offset;
 
-            if (bb == func->bbs) {
-                /* save ra, sp */
-                elf_offset += 16;
+            if (bb == func->bbs && !func->frameless) {
+                /* save ra, the s-registers and sp */
+                elf_offset += 16 + saved_regs_size(func->saved_regs);
             }
 
             for (ph2_ir_t *insn = bb->ph2_ir_list.head; insn;
@@ -160,14 +309,31 @@ void cfg_flatten(void)
                 flatten_ir = add_existed_ph2_ir(insn);
 
                 if (insn->op == OP_return) {
-                    /* restore sp */
-                    flatten_ir->src1 = bb->belong_to->stack_size;
+                    /* restore sp and the saved registers */
+                    flatten_ir->src1 = stack_size;
+                    flatten_ir->dest = func->saved_regs;
                 }
 
+                if (flatten_ir->calls_runtime_helper) {
+                    if (flatten_ir->op == OP_mul)
+                        mul_used = true;
+                    else
+                        divmod_used = true;
+                }
                 update_elf_offset(flatten_ir);
             }
         }
     }
+
+    /* the runtime helpers follow the last function */
+    if (mul_used) {
+        mul_helper_ofs = elf_offset;
+        elf_offset += 40;
+    }
+    if (divmod_used) {
+        divmod_helper_ofs = elf_offset;
+        elf_offset += 112;
+    }
 }
 
 void emit(int code)
@@ -175,13 +341,241 @@ void emit(int code)
     elf_write_int(elf_code, code);
 }
 
+/* Load 'value' into 'rd' */
+void rv_emit_li(rv_reg rd, int value)
+{
+    if (value < -2048 || value > 2047) {
+        emit(__lui(rd, rv_hi(value)));
+        emit(__addi(rd, rd, rv_lo(value)));
+    } else
+        emit(__addi(rd, __zero, value));
+}
+
+/* Division and modulo of rs1 by a constant without dividing. Powers of 2 are
+ * shifts, with negative dividends biased by 2^k - 1 to round toward zero.
+ * With the M extension, other divisors multiply by a fixed-point reciprocal,
+ * see div_magic(). Without it, the quotient of |rs1| is estimated from below
+ * with shifts and adds of the bits of 2^(32 + e) / |divisor|, where 2^e is
+ * the largest power of 2 below the divisor, and a short loop corrects the
+ * estimate. When the bits of the reciprocal repeat with a short period, only
+ * one period is summed and then replicated by shifting.
+ */
+void rv_emit_div_const(ph2_ir_t *ph2_ir)
+{
+    int rd = rv_reg_of(ph2_ir->dest), rs1 = rv_reg_of(ph2_ir->src0);
+    int divisor = ph2_ir->src1;
+    int abs_divisor = divisor < 0 ? -divisor : divisor;
+    int shift = pow2_shift(abs_divisor), magic, period, rem, i;
+    bool first;
+
+    if (shift > 0) {
+        emit(__srai(__t0, rs1, 31));
+        emit(__srli(__t0, __t0, 32 - shift));
+        emit(__add(__t0, rs1, __t0));
+        if (ph2_ir->op == OP_mod_const) {
+            emit(__srai(__t0, __t0, shift));
+            emit(__slli(__t0, __t0, shift));
+            emit(__sub(rd, rs1, __t0));
+        } else if (divisor > 0)
+            emit(__srai(rd, __t0, shift));
+        else {
+            emit(__srai(__t0, __t0, shift));
+            emit(__sub(rd, __zero, __t0));
+        }
+        return;
+    }
+
+    if (hard_mul_div) {
+        div_magic(abs_divisor, &magic, &shift);
+        rv_emit_li(__t0, magic);
+        emit(__mulh(__t0, rs1, __t0));
+        if (magic < 0)
+            emit(__add(__t0, __t0, rs1));
+        if (shift > 0)
+            emit(__srai(__t0, __t0, shift));
+        /* the estimate is one below the quotient of negative dividends */
+        emit(__srli(__t1, rs1, 31));
+        if (ph2_ir->op == OP_div_const && divisor > 0) {
+            emit(__add(rd, __t0, __t1));
+            return;
+        }
+        emit(__add(__t0, __t0, __t1));
+        if (ph2_ir->op == OP_div_const) {
+            emit(__sub(rd, __zero, __t0));
+            return;
+        }
+        rv_emit_li(__t1, abs_divisor);
+        emit(__mul(__t0, __t0, __t1));
+        emit(__sub(rd, rs1, __t0));
+        return;
+    }
+
+    /* t0 holds the sign mask of the dividend and t1 its magnitude */
+    emit(__srai(__t0, rs1, 31));
+    emit(__xor(__t1, rs1, __t0));
+    emit(__sub(__t1, __t1, __t0));
+
+    /* quotient estimate in t2 */
+    shift = rv_log2(abs_divisor);
+    magic = div_reciprocal(abs_divisor, shift, &rem);
+    period = rv_recip_period(abs_divisor);
+    first = true;
+    for (i = 31; i >= (period ? 32 - period : 1); i--) {
+        if (!((magic >> i) & 1))
+            continue;
+        if (first)
+            emit(__srli(__t2, __t1, 32 - i));
+        else {
+            emit(__srli(__t3, __t1, 32 - i));
+            emit(__add(__t2, __t2, __t3));
+        }
+        first = false;
+    }
+    for (i = period; period && i < 32; i += i) {
+        emit(__srli(__t3, __t2, i));
+        emit(__add(__t2, __t2, __t3));
+    }
+    emit(__srli(__t2, __t2, shift));
+
+    /* remainder in t4 */
+    first = true;
+    for (i = 0; i < 32; i++) {
+        if (!((abs_divisor >> i) & 1))
+            continue;
+        if (first)
+            emit(__slli(__t4, __t2, i));
+        else {
+            emit(__slli(__t3, __t2, i));
+            emit(__add(__t4, __t4, __t3));
+        }
+        first = false;
+    }
+    emit(__sub(__t4, __t1, __t4));
+
+    /* the estimate never exceeds the quotient */
+    rv_emit_li(__t5, abs_divisor);
+    emit(__bltu(__t4, __t5, 16));
+    emit(__sub(__t4, __t4, __t5));
+    emit(__addi(__t2, __t2, 1));
+    emit(__jal(__zero, -12));
+
+    if (ph2_ir->op == OP_mod_const) {
+        emit(__xor(__t4, __t4, __t0));
+        emit(__sub(rd, __t4, __t0));
+        return;
+    }
+    if (divisor < 0)
+        emit(__xori(__t0, __t0, -1));
+    emit(__xor(__t2, __t2, __t0));
+    emit(__sub(rd, __t2, __t0));
+}
+
+/* Multiplication of rs1 by a constant in the steps of mul_const_plan(). The
+ * partial product is kept in t0 and shifted into t1, and the last step writes
+ * rd.
+ */
+void rv_emit_mul_const(ph2_ir_t *ph2_ir)
+{
+    int plan[MAX_MUL_STEPS];
+    int rd = rv_reg_of(ph2_ir->dest), rs1 = rv_reg_of(ph2_ir->src0), p = rs1;
+
+    mul_const_plan(ph2_ir->src1, plan);
+    for (int i = 1; i <= plan[0]; i++) {
+        int k = plan[i] & 31, dest = __t0;
+
+        if (i == plan[0])
+            dest = rd;
+        switch (plan[i] >> 5) {
+        case MUL_ADD_X:
+            emit(__slli(__t1, p, k));
+            emit(__add(dest, __t1, rs1));
+            break;
+        case MUL_SUB_X:
+            emit(__slli(__t1, p, k));
+            emit(__sub(dest, __t1, rs1));
+            break;
+        case MUL_ADD_P:
+            emit(__slli(__t1, p, k));
+            emit(__add(dest, __t1, p));
+            break;
+        case MUL_SUB_P:
+            emit(__slli(__t1, p, k));
+            emit(__sub(dest, __t1, p));
+            break;
+        case MUL_SHIFT:
+            emit(__slli(dest, p, k));
+            break;
+        default: /* MUL_NEGATE */
+            emit(__sub(dest, __zero, p));
+            break;
+        }
+        p = __t0;
+    }
+}
+
+/* Runtime helper for the software multiplication of t3 by t4. It returns the
+ * product in t0 and clobbers t1, t3 and t4.
+ */
+void rv_emit_mul_helper(void)
+{
+    emit(__addi(__t0, __zero, 0));
+    emit(__beq(__t3, __zero, 32));
+    emit(__beq(__t4, __zero, 28));
+    emit(__andi(__t1, __t4, 1));
+    emit(__beq(__t1, __zero, 8));
+    emit(__add(__t0, __t0, __t3));
+    emit(__slli(__t3, __t3, 1));
+    emit(__srli(__t4, __t4, 1));
+    emit(__jal(__zero, -28));
+    emit(__jalr(__zero, __ra, 0));
+}
+
+/* Runtime helper for the software division of t2 by t3. It returns the
+ * quotient in t0 and the remainder in t2, and clobbers t1, t3, t4 and t5.
+ */
+void rv_emit_divmod_helper(void)
+{
+    /* Obtain absolute values of the dividend and divisor */
+    emit(__srai(__t0, __t2, 31));
+    emit(__add(__t2, __t2, __t0));
+    emit(__xor(__t2, __t2, __t0));
+    emit(__srai(__t1, __t3, 31));
+    emit(__add(__t3, __t3, __t1));
+    emit(__xor(__t3, __t3, __t1));
+    /* t5 holds the sign of the quotient, t4 that of the remainder */
+    emit(__xor(__t5, __t0, __t1));
+    emit(__addi(__t4, __t0, 0));
+    /* Unsigned integer division */
+    emit(__addi(__t0, __zero, 0));
+    emit(__addi(__t1, __zero, 1));
+    emit(__beq(__t3, __zero, 52));
+    emit(__beq(__t2, __zero, 48));
+    emit(__beq(__t2, __t3, 20));
+    emit(__bltu(__t2, __t3, 16));
+    emit(__slli(__t3, __t3, 1));
+    emit(__slli(__t1, __t1, 1));
+    emit(__jal(__zero, -16));
+    emit(__bltu(__t2, __t3, 12));
+    emit(__sub(__t2, __t2, __t3));
+    emit(__add(__t0, __t0, __t1));
+    emit(__srli(__t1, __t1, 1));
+    emit(__srli(__t3, __t3, 1));
+    emit(__bne(__t1, __zero, -20));
+    /* Handle the correct signs for the quotient and remainder */
+    emit(__xor(__t0, __t0, __t5));
+    emit(__sub(__t0, __t0, __t5));
+    emit(__xor(__t2, __t2, __t4));
+    emit(__sub(__t2, __t2, __t4));
+    emit(__jalr(__zero, __ra, 0));
+}
+
 void emit_ph2_ir(ph2_ir_t *ph2_ir)
 {
     func_t *func;
-    int rd = ph2_ir->dest + 10;
-    int rs1 = ph2_ir->src0 + 10;
-    int rs2 = ph2_ir->src1 + 10;
-    int ofs;
+    int rd = rv_reg_of(ph2_ir->dest);
+    int rs1 = rv_reg_of(ph2_ir->src0);
+    int rs2 = rv_reg_of(ph2_ir->src1);
+    int ofs, i;
 
     /* Prepare the variables to reuse the same code for
      * the instruction sequence of
@@ -193,9 +587,24 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
 
     switch (ph2_ir->op) {
     case OP_define:
+        /* ra and the s-registers in ph2_ir->src1 are saved right below the
+         * caller's sp, on top of the local stack. A leaf function without
+         * stack slots or s-registers has ph2_ir->src0 set to -1 and keeps
+         * ra and sp as they are.
+         */
+        if (ph2_ir->src0 < 0)
+            return;
         emit(__sw(__ra, __sp, -4));
-        emit(__lui(__t0, rv_hi(ph2_ir->src0 + 4)));
-        emit(__addi(__t0, __t0, rv_lo(ph2_ir->src0 + 4)));
+        ofs = -4;
+        for (i = 0; i < 32; i++) {
+            if ((ph2_ir->src1 >> i) & 1) {
+                ofs -= 4;
+                emit(__sw(rv_reg_of(i), __sp, ofs));
+            }
+        }
+        ofs = ph2_ir->src0 - ofs;
+        emit(__lui(__t0, rv_hi(ofs)));
+        emit(__addi(__t0, __t0, rv_lo(ofs)));
         emit(__sub(__sp, __sp, __t0));
         return;
     case OP_load_constant:
@@ -242,7 +651,10 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
             emit(__sw(rs1, interm, ph2_ir->src1));
         return;
     case OP_read:
+        /* a negative size reads a sign-extended byte, see known_bits() */
         if (ph2_ir->src1 == 1)
+            emit(__lbu(rd, rs1, 0));
+        else if (ph2_ir->src1 == -1)
             emit(__lb(rd, rs1, 0));
         else if (ph2_ir->src1 == 2)
             emit(__lh(rd, rs1, 0));
@@ -265,7 +677,32 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
         ofs = elf_code_start + ph2_ir->then_bb->elf_offset;
         emit(__lui(__t0, rv_hi(ofs)));
         emit(__addi(__t0, __t0, rv_lo(ofs)));
-        emit(__beq(rs1, __zero, 8));
+        /* skip the jump to 'then' unless the condition holds; a fused
+         * comparison is evaluated by the branch, see ra_fusible_branch()
+         */
+        switch (ph2_ir->branch_cmp) {
+        case OP_eq:
+            emit(__bne(rs1, rs2, 8));
+            break;
+        case OP_neq:
+            emit(__beq(rs1, rs2, 8));
+            break;
+        case OP_lt:
+            emit(__bge(rs1, rs2, 8));
+            break;
+        case OP_geq:
+            emit(__blt(rs1, rs2, 8));
+            break;
+        case OP_gt:
+            emit(__bge(rs2, rs1, 8));
+            break;
+        case OP_leq:
+            emit(__blt(rs2, rs1, 8));
+            break;
+        default:
+            emit(__beq(rs1, __zero, 8));
+            break;
+        }
         emit(__jalr(__zero, __t0, 0));
         emit(__jal(__zero, ph2_ir->else_bb->elf_offset - elf_code->size));
         return;
@@ -298,14 +735,30 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
         emit(__jalr(__ra, __t0, 0));
         return;
     case OP_return:
+        if (ph2_ir->src1 < 0) {
+            /* frameless function */
+            if (ph2_ir->src0 > 0)
+                emit(__addi(__a0, rs1, 0));
+            emit(__jalr(__zero, __ra, 0));
+            return;
+        }
+
         if (ph2_ir->src0 == -1)
             emit(__addi(__zero, __zero, 0));
         else
             emit(__addi(__a0, rs1, 0));
-        emit(__lui(__t0, rv_hi(ph2_ir->src1 + 4)));
-        emit(__addi(__t0, __t0, rv_lo(ph2_ir->src1 + 4)));
+        ofs = ph2_ir->src1 + 4 + saved_regs_size(ph2_ir->dest);
+        emit(__lui(__t0, rv_hi(ofs)));
+        emit(__addi(__t0, __t0, rv_lo(ofs)));
         emit(__add(__sp, __sp, __t0));
         emit(__lw(__ra, __sp, -4));
+        ofs = -4;
+        for (i = 0; i < 32; i++) {
+            if ((ph2_ir->dest >> i) & 1) {
+                ofs -= 4;
+                emit(__lw(rv_reg_of(i), __sp, ofs));
+            }
+        }
         emit(__jalr(__zero, __ra, 0));
         return;
     case OP_add:
@@ -317,7 +770,12 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
     case OP_mul:
         if (hard_mul_div)
             emit(__mul(rd, rs1, rs2));
-        else {
+        else if (ph2_ir->calls_runtime_helper) {
+            emit(__addi(__t3, rs1, 0));
+            emit(__addi(__t4, rs2, 0));
+            emit(__jal(__ra, mul_helper_ofs - elf_code->size));
+            emit(__addi(rd, __t0, 0));
+        } else {
             emit(__addi(__t0, __zero, 0));
             emit(__addi(__t1, __zero, 0));
             emit(__addi(__t3, rs1, 0));
@@ -342,6 +800,16 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
                 emit(__mod(rd, rs1, rs2));
             return;
         }
+        if (ph2_ir->calls_runtime_helper) {
+            emit(__addi(__t2, rs1, 0));
+            emit(__addi(__t3, rs2, 0));
+            emit(__jal(__ra, divmod_helper_ofs - elf_code->size));
+            if (ph2_ir->op == OP_div)
+                emit(__addi(rd, __t0, 0));
+            else
+                emit(__addi(rd, __t2, 0));
+            return;
+        }
         interm = __t0;
         /* div/mod emulation */
         if (ph2_ir->op == OP_mod) {
@@ -383,6 +851,13 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
         emit(__beq(__t5, __zero, 8));
         emit(__sub(rd, __zero, rd));
         return;
+    case OP_div_const:
+    case OP_mod_const:
+        rv_emit_div_const(ph2_ir);
+        return;
+    case OP_mul_const:
+        rv_emit_mul_const(ph2_ir);
+        return;
     case OP_lshift:
         emit(__sll(rd, rs1, rs2));
         return;
@@ -525,4 +1000,9 @@ void code_generate(void)
         ph2_ir = PH2_IR_FLATTEN[i];
         emit_ph2_ir(ph2_ir);
     }
+
+    if (mul_helper_ofs >= 0)
+        rv_emit_mul_helper();
+    if (divmod_helper_ofs >= 0)
+        rv_emit_divmod_helper();
 }
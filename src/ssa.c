@@ -12,6 +12,7 @@
 
 /* SCCP (Sparse Conditional Constant Propagation) optimization */
 #include "opt-sccp.c"
+#include "opt-known-bits.c"
 
 /* Configuration constants - replace magic numbers */
 #define PHI_WORKLIST_SIZE 128
@@ -914,16 +915,69 @@ void append_unwound_phi_insn(basic_block_t *bb, var_t *dest, var_t *rs)
             tail->prev = n;
         } else {
             tail->next = n;
+            n->prev = tail;
             bb->insn_list.tail = n;
         }
     }
 }
 
+/* Give each edge into 'bb' from a block with two successors a block of its
+ * own, so that the phi copies of 'bb' run on that edge only.
+ */
+void bb_split_critical_edges(basic_block_t *bb)
+{
+    for (int i = 0; i < MAX_BB_PRED; i++) {
+        basic_block_t *pred = bb->prev[i].bb;
+
+        if (!pred || !pred->then_ || !pred->else_ ||
+            pred->then_ == pred->else_)
+            continue;
+
+        basic_block_t *mid = bb_create(pred->scope);
+        if (pred->then_ == bb)
+            pred->then_ = mid;
+        else
+            pred->else_ = mid;
+        mid->prev[0].bb = pred;
+        mid->prev[0].type = bb->prev[i].type;
+        mid->next = bb;
+        bb->prev[i].bb = mid;
+        bb->prev[i].type = NEXT;
+        mid->idom = pred;
+        dom_connect(pred, mid);
+
+        /* the block follows its predecessor on a back edge, and falls
+         * through into 'bb' otherwise
+         */
+        basic_block_t *after = pred;
+        if (pred->rpo < bb->rpo) {
+            while (after->rpo_next && after->rpo_next != bb)
+                after = after->rpo_next;
+            if (!after->rpo_next)
+                after = pred;
+        }
+        mid->rpo_next = after->rpo_next;
+        after->rpo_next = mid;
+
+        for (insn_t *insn = bb->insn_list.head;
+             insn && insn->opcode == OP_phi; insn = insn->next) {
+            for (phi_operand_t *operand = insn->phi_ops; operand;
+                 operand = operand->next) {
+                if (operand->from == pred)
+                    operand->from = mid;
+            }
+        }
+    }
+}
+
 void bb_unwind_phi(func_t *func, basic_block_t *bb)
 {
     UNUSED(func);
 
-    insn_t *insn;
+    insn_t *insn = bb->insn_list.head;
+    if (insn && insn->opcode == OP_phi)
+        bb_split_critical_edges(bb);
+
     for (insn = bb->insn_list.head; insn; insn = insn->next) {
         if (insn->opcode != OP_phi)
             break;
@@ -954,6 +1008,11 @@ void unwind_phi(void)
         func->visited++;
         args->preorder_cb = bb_unwind_phi;
         bb_forward_traversal(args);
+
+        /* number the blocks inserted on critical edges */
+        func->bb_cnt = 0;
+        for (basic_block_t *bb = func->bbs; bb; bb = bb->rpo_next)
+            bb->rpo = func->bb_cnt++;
     }
 }
 
@@ -2335,8 +2394,12 @@ void optimize(void)
                     }
                 }
 
-                /* Strength reduction for power-of-2 operations */
-                if (insn->rs2 && insn->rs2->is_const && insn->rd) {
+                /* Strength reduction: x * power_of_2 = x << shift. Division
+                 * and modulo by constants are expanded by the backends, which
+                 * round toward zero for negative dividends as well.
+                 */
+                if (insn->opcode == OP_mul && insn->rs2 &&
+                    insn->rs2->is_const && insn->rd) {
                     int val = insn->rs2->init_val;
 
                     /* Check if value is power of 2 */
@@ -2349,21 +2412,8 @@ void optimize(void)
                             shift++;
                         }
 
-                        /* x * power_of_2 = x << shift */
-                        if (insn->opcode == OP_mul) {
-                            insn->opcode = OP_lshift;
-                            insn->rs2->init_val = shift;
-                        }
-                        /* x / power_of_2 = x >> shift (unsigned) */
-                        else if (insn->opcode == OP_div) {
-                            insn->opcode = OP_rshift;
-                            insn->rs2->init_val = shift;
-                        }
-                        /* x % power_of_2 = x & (power_of_2 - 1) */
-                        else if (insn->opcode == OP_mod) {
-                            insn->opcode = OP_bit_and;
-                            insn->rs2->init_val = val - 1;
-                        }
+                        insn->opcode = OP_lshift;
+                        insn->rs2->init_val = shift;
                     }
                 }
 
@@ -2428,6 +2478,17 @@ void optimize(void)
         }
     }
 
+    /* Drop extensions of values that already have the right upper bits,
+     * after CSE so that no plain read is merged into a sign-extending one
+     */
+    for (func_t *func = FUNC_LIST.head; func; func = func->next) {
+        /* Skip function declarations without bodies */
+        if (!func->bbs)
+            continue;
+
+        known_bits(func);
+    }
+
     /* Mark useful instructions */
     for (func_t *func = FUNC_LIST.head; func; func = func->next) {
         /* Skip function declarations without bodies */
@@ -2509,6 +2570,20 @@ void bb_reset_live_kill_idx(func_t *func, basic_block_t *bb)
 void add_live_gen(basic_block_t *bb, var_t *var);
 void update_consumed(insn_t *insn, var_t *var);
 
+/* The phi copies at the end of a block run in parallel: their sources are
+ * read before any of the results is written, so the results are killed
+ * only after all of them.
+ */
+void bb_kill_unwound_phis(basic_block_t *bb)
+{
+    for (insn_t *insn = bb->insn_list.tail; insn; insn = insn->prev) {
+        if (insn->opcode == OP_unwound_phi)
+            bb_add_killed_var(bb, insn->rd);
+        else if (insn->opcode != OP_branch && insn->opcode != OP_jump)
+            break;
+    }
+}
+
 /* Combined function to reset and solve locals in one pass */
 void bb_reset_and_solve_locals(func_t *func, basic_block_t *bb)
 {
@@ -2535,6 +2610,8 @@ void bb_reset_and_solve_locals(func_t *func, basic_block_t *bb)
         if (insn->rd && insn->opcode != OP_unwound_phi)
             bb_add_killed_var(bb, insn->rd);
     }
+
+    bb_kill_unwound_phis(bb);
 }
 
 void add_live_gen(basic_block_t *bb, var_t *var)
@@ -2573,6 +2650,8 @@ void bb_solve_locals(func_t *func, basic_block_t *bb)
             if (insn->opcode != OP_unwound_phi)
                 bb_add_killed_var(bb, insn->rd);
     }
+
+    bb_kill_unwound_phis(bb);
 }
 
 void add_live_in(basic_block_t *bb, var_t *var)
@@ -2236,6 +2236,72 @@ begin_category "Switch Statements" "Testing switch-case control flow"
 items 10 "int a; a = 0; switch (3) { case 0: return 2; case 3: a = 10; break; case 1: return 0; } return a;"
 items 10 "int a; a = 0; switch (3) { case 0: return 2; default: a = 10; break; } return a;"
 
+# sparse cases, runs of labels and a default label in the middle
+try_ 0 << EOF
+int classify(int c)
+{
+    int r = 0;
+    switch (c) {
+    case 1:
+        return 1;
+    case 'a':
+    case 'b':
+    case 'c':
+    case 'd':
+        return 2;
+    case 1000:
+        r = 3;
+        break;
+    case 7:
+        r += 4;
+    default:
+        r += 5;
+    case 8:
+        r += 6;
+        break;
+    case 42:
+    case 44:
+        return 8;
+    }
+    return r;
+}
+
+int nested(int x, int y)
+{
+    switch (x) {
+    case 0:
+        switch (y) {
+        case 1:
+            return 1;
+        case 2:
+            return 2;
+        }
+        return 3;
+    case 1:
+    case 2:
+        return 4;
+    }
+    return 5;
+}
+
+int main()
+{
+    if (classify(1) != 1 || classify('b') != 2 || classify('d') != 2)
+        return 1;
+    if (classify('e') != 11 || classify(1000) != 3 || classify(7) != 15)
+        return 2;
+    if (classify(8) != 6 || classify(0) != 11 || classify(-2) != 11)
+        return 3;
+    if (classify(42) != 8 || classify(43) != 11 || classify(44) != 8)
+        return 4;
+    if (nested(0, 1) != 1 || nested(0, 2) != 2 || nested(0, 3) != 3)
+        return 5;
+    if (nested(2, 0) != 4 || nested(3, 0) != 5)
+        return 6;
+    return 0;
+}
+EOF
+
 # Category: Enumerations
 begin_category "Enumerations" "Testing enum declarations and usage"
 
@@ -3150,6 +3216,134 @@ int main()
 }
 EOF
 
+# Division and modulo by constants round toward zero
+ans="-1073741823 -3 268435455 -15 -715827882 -1 -214748364 -7 306783378 -647 -21474
+-500000 -1 125000 -1 -333333 -2 -100000 -1 142857 -1 -10
+-38 -1 9 -13 -25 0 -7 -7 11 -77 0
+-3 -3 0 -7 -2 0 0 -7 1 -7 0
+3 3 0 7 2 0 0 7 -1 7 0
+1073741823 3 -268435455 15 715827882 1 214748364 7 -306783378 647 21474"
+
+try_output 0 "$ans" << EOF
+int main()
+{
+    int x[6] = {-2147483647, -1000001, -77, -7, 7, 2147483647};
+
+    for (int i = 0; i < 6; i++) {
+        int v = x[i];
+        printf("%d %d %d %d ", v / 2, v % 4, v / -8, v % -16);
+        printf("%d %d %d %d ", v / 3, v % 7, v / 10, v % 10);
+        printf("%d %d %d\n", v / -7, v % 1000, v / 100000);
+    }
+    return 0;
+}
+EOF
+
+# Multiplication by constants, as shifts and additions where cheaper
+ans="-139023 -463410 556092 -2085345 -11816955 -46341000 -1258009861
+-21 -70 84 -315 -1785 -7000 458745
+39 130 -156 585 3315 13000 -851955
+2147483645 -10 12 2147483603 2147483393 -1000 -2147418113
+49"
+
+try_output 0 "$ans" << EOF
+typedef struct {
+    int a, b, c;
+} triple_t;
+
+int main()
+{
+    int x[4] = {-46341, -7, 13, 2147483647};
+    triple_t t[5];
+
+    for (int i = 0; i < 4; i++) {
+        int v = x[i];
+        printf("%d %d %d %d ", v * 3, v * 10, v * -12, 45 * v);
+        printf("%d %d %d\n", v * 255, v * 1000, v * -65535);
+    }
+    for (int i = 0; i < 5; i++)
+        t[i].b = i * 7;
+    printf("%d\n", t[3].b + t[4].b);
+    return 0;
+}
+EOF
+
+# Byte and halfword reads extended to int, with redundant extensions dropped
+try_output 0 "-25664 8242 34" << EOF
+int main()
+{
+    char s[4];
+    short h[2];
+    int t = 0, m = 0, n = 0;
+
+    s[0] = -3;
+    s[1] = 100;
+    s[2] = -128;
+    s[3] = 127;
+    h[0] = -30000;
+    h[1] = 1234;
+    for (int i = 0; i < 4; i++) {
+        char c = s[i];
+        int v = c;
+        t = t * 7 + v;
+        m = m * 3 + (s[i] & 255);
+        n += (v < 0) + (s[i] & 15);
+    }
+    for (int i = 0; i < 2; i++) {
+        short w = h[i];
+        int v = w;
+        t += v;
+    }
+    printf("%d %d %d\n", t, m, n);
+    return 0;
+}
+EOF
+
+# Comparisons evaluated by the branch using them, and as values
+ans="14 41 50 45 1
+49"
+
+try_output 0 "$ans" << EOF
+int f(int a, int b)
+{
+    int n = 0;
+
+    if (a == b)
+        n += 1;
+    if (a != b)
+        n += 2;
+    if (a < b)
+        n += 4;
+    if (a <= b)
+        n += 8;
+    if (a > b)
+        n += 16;
+    if (a >= b)
+        n += 32;
+    return n;
+}
+
+int main()
+{
+    int s = 0, i = 0, t;
+
+    while (i < 10) {
+        s += i;
+        i++;
+    }
+    t = s > 40;
+    printf("%d %d %d %d %d\n", f(1, 2), f(2, 2), f(3, -2), s, t);
+    for (i = 0; i < 5; i++) {
+        int c = i > 2;
+        if (c)
+            s++;
+        s += c;
+    }
+    printf("%d\n", s);
+    return 0;
+}
+EOF
+
 # _Bool size should be equivalent to char, which is 1 byte
 try_output 0 "1" << EOF
 int main()